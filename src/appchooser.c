@@ -39,6 +39,7 @@
 #include "xdg-desktop-portal-dbus.h"
 
 #include "appchooserdialog.h"
+#include "appinfoindex.h"
 #include "externalwindow.h"
 
 static GHashTable *handles;
@@ -275,6 +276,8 @@ app_chooser_init (GDBusConnection *bus,
 
   handles = g_hash_table_new (g_str_hash, g_str_equal);
 
+  app_info_index_ensure ();
+
   g_debug ("providing %s", g_dbus_interface_skeleton_get_info (helper)->name);
 
   return TRUE;
@@ -30,9 +30,12 @@
 
 #include "appchooserdialog.h"
 #include "appchooserrow.h"
+#include "appinfoindex.h"
 
 #define LOCATION_MAX_LENGTH 40
 #define INITIAL_LIST_SIZE 3
+#define POPULATE_BUDGET_US 5000
+#define UPDATE_CHOICES_DELAY 100
 
 struct _AppChooserDialog {
   GtkWindow parent;
@@ -50,7 +53,11 @@ struct _AppChooserDialog {
 
   char *content_type;
 
-  char **choices;
+  GPtrArray *choices;
+  GHashTable *known_choices;
+  guint n_rows;
+  guint populate_id;
+  guint update_id;
 
   GtkWidget *selected_row;
   GtkWidget *more_row;
@@ -97,13 +104,34 @@ app_chooser_dialog_init (AppChooserDialog *dialog)
   gtk_list_box_set_header_func (GTK_LIST_BOX (dialog->list), update_header, NULL, NULL);
 }
 
+static void
+app_chooser_dialog_dispose (GObject *object)
+{
+  AppChooserDialog *dialog = APP_CHOOSER_DIALOG (object);
+
+  if (dialog->populate_id)
+    {
+      g_source_remove (dialog->populate_id);
+      dialog->populate_id = 0;
+    }
+
+  if (dialog->update_id)
+    {
+      g_source_remove (dialog->update_id);
+      dialog->update_id = 0;
+    }
+
+  G_OBJECT_CLASS (app_chooser_dialog_parent_class)->dispose (object);
+}
+
 static void
 app_chooser_dialog_finalize (GObject *object)
 {
   AppChooserDialog *dialog = APP_CHOOSER_DIALOG (object);
 
   g_free (dialog->content_type);
-  g_strfreev (dialog->choices);
+  g_hash_table_unref (dialog->known_choices);
+  g_ptr_array_unref (dialog->choices);
 
   G_OBJECT_CLASS (app_chooser_dialog_parent_class)->finalize (object);
 }
@@ -122,28 +150,65 @@ close_dialog (AppChooserDialog *dialog,
   g_signal_emit (dialog, signals[CLOSE], 0);
 }
 
+static GtkWidget *
+add_row (AppChooserDialog *dialog,
+         const char *choice)
+{
+  g_autoptr(GAppInfo) info = app_info_index_lookup (choice);
+  GtkWidget *row;
+
+  row = GTK_WIDGET (app_chooser_row_new (info));
+  gtk_widget_set_visible (row, TRUE);
+  gtk_list_box_insert (GTK_LIST_BOX (dialog->list), row, -1);
+  dialog->n_rows++;
+
+  return row;
+}
+
+/* With many choices, building all the rows at once stalls the dialog
+ * right after "more" was clicked. Add them a few at a time instead.
+ */
+static gboolean
+populate_rows (gpointer data)
+{
+  AppChooserDialog *dialog = data;
+  gint64 start;
+
+  start = g_get_monotonic_time ();
+
+  while (dialog->n_rows < dialog->choices->len)
+    {
+      add_row (dialog, g_ptr_array_index (dialog->choices, dialog->n_rows));
+
+      if (g_get_monotonic_time () - start > POPULATE_BUDGET_US)
+        break;
+    }
+
+  if (dialog->n_rows < dialog->choices->len)
+    return G_SOURCE_CONTINUE;
+
+  dialog->populate_id = 0;
+  return G_SOURCE_REMOVE;
+}
+
 static void
-show_more (AppChooserDialog *dialog)
+schedule_populate (AppChooserDialog *dialog)
 {
-  int i;
+  if (dialog->populate_id == 0)
+    dialog->populate_id = g_idle_add (populate_rows, dialog);
+}
 
+static void
+show_more (AppChooserDialog *dialog)
+{
   gtk_scrolled_window_set_policy (GTK_SCROLLED_WINDOW (dialog->scrolled_window),
                                   GTK_POLICY_NEVER, GTK_POLICY_AUTOMATIC);
   gtk_window_set_resizable (GTK_WINDOW (dialog), TRUE);
   gtk_widget_hide (dialog->more_row);
 
-  g_return_if_fail (g_strv_length ((char **)dialog->choices) > INITIAL_LIST_SIZE);
+  g_return_if_fail (dialog->choices->len > INITIAL_LIST_SIZE);
 
-  for (i = INITIAL_LIST_SIZE; dialog->choices[i]; i++)
-    {
-      g_autofree char *desktop_id = g_strconcat (dialog->choices[i], ".desktop", NULL);
-      g_autoptr(GAppInfo) info = G_APP_INFO (g_desktop_app_info_new (desktop_id));
-      GtkWidget *row;
-
-      row = GTK_WIDGET (app_chooser_row_new (info));
-      gtk_widget_set_visible (row, TRUE);
-      gtk_list_box_insert (GTK_LIST_BOX (dialog->list), row, -1);
-   }
+  schedule_populate (dialog);
 }
 
 static void
@@ -257,6 +322,7 @@ app_chooser_dialog_class_init (AppChooserDialogClass *class)
   GObjectClass *object_class = G_OBJECT_CLASS (class);
   GtkBindingSet *binding_set;
 
+  object_class->dispose = app_chooser_dialog_dispose;
   object_class->finalize = app_chooser_dialog_finalize;
 
   widget_class->delete_event = app_chooser_delete_event;
@@ -392,9 +458,17 @@ app_chooser_dialog_new (const char **choices,
 
   ensure_default_in_initial_list (choices, default_id);
 
-  dialog->choices = g_strdupv ((char **)choices);
-
   n_choices = g_strv_length ((char **)choices);
+
+  dialog->choices = g_ptr_array_new_full (n_choices, g_free);
+  dialog->known_choices = g_hash_table_new (g_str_hash, g_str_equal);
+  for (i = 0; i < n_choices; i++)
+    {
+      char *choice = g_strdup (choices[i]);
+
+      g_ptr_array_add (dialog->choices, choice);
+      g_hash_table_add (dialog->known_choices, choice);
+    }
   if (n_choices == 0)
     {
       gtk_widget_show (dialog->empty_box);
@@ -418,13 +492,9 @@ app_chooser_dialog_new (const char **choices,
       gtk_widget_grab_default (dialog->open_button);
       for (i = 0; i < MIN (n_choices, INITIAL_LIST_SIZE); i++)
         {
-          g_autofree char *desktop_id = g_strconcat (choices[i], ".desktop", NULL);
-          g_autoptr(GAppInfo) info = G_APP_INFO (g_desktop_app_info_new (desktop_id));
           GtkWidget *row;
 
-          row = GTK_WIDGET (app_chooser_row_new (info));
-          gtk_widget_set_visible (row, TRUE);
-          gtk_list_box_insert (GTK_LIST_BOX (dialog->list), row, -1);
+          row = add_row (dialog, choices[i]);
 
           if (default_id && strcmp (choices[i], default_id) == 0)
             {
@@ -463,42 +533,47 @@ app_chooser_dialog_new (const char **choices,
   return dialog;
 }
 
+static gboolean
+update_rows (gpointer data)
+{
+  AppChooserDialog *dialog = data;
+
+  dialog->update_id = 0;
+
+  schedule_populate (dialog);
+
+  return G_SOURCE_REMOVE;
+}
+
+/* The frontend sends updates in bursts while apps are being installed,
+ * so new choices are merged right away but rows for them are added
+ * at most once per UPDATE_CHOICES_DELAY.
+ */
 void
 app_chooser_dialog_update_choices (AppChooserDialog  *dialog,
                                    const char       **choices)
 {
+  gboolean changed = FALSE;
   int i;
-  GPtrArray *new_choices;
-
-  new_choices = g_ptr_array_new ();
-  g_ptr_array_set_size (new_choices, g_strv_length (dialog->choices));
-  for (i = 0; dialog->choices[i]; i++)
-    new_choices->pdata[i] = dialog->choices[i];
 
   for (i = 0; choices[i]; i++)
     {
-      if (g_strv_contains ((const char * const *)dialog->choices, choices[i]))
-        continue;
-
-      g_ptr_array_add (new_choices, g_strdup (choices[i]));
+      char *choice;
 
-      if (dialog->more_row && !gtk_widget_get_visible (dialog->more_row))
-        {
-          g_autofree char *desktop_id = NULL;
-          g_autoptr(GAppInfo) info = NULL;
-          GtkWidget *row;
-
-          desktop_id = g_strconcat (choices[i], ".desktop", NULL);
-          info = G_APP_INFO (g_desktop_app_info_new (desktop_id));
+      if (g_hash_table_contains (dialog->known_choices, choices[i]))
+        continue;
 
-          row = GTK_WIDGET (app_chooser_row_new (info));
-          gtk_widget_set_visible (row, TRUE);
-          gtk_list_box_insert (GTK_LIST_BOX (dialog->list), row, -1);
-       }
+      choice = g_strdup (choices[i]);
+      g_ptr_array_add (dialog->choices, choice);
+      g_hash_table_add (dialog->known_choices, choice);
+      changed = TRUE;
     }
 
-  g_ptr_array_add (new_choices, NULL);
+  if (!changed)
+    return;
 
-  g_free (dialog->choices);
-  dialog->choices = (char **) g_ptr_array_free (new_choices, FALSE);
+  /* A running populate_rows() picks up the new choices by itself */
+  if (dialog->more_row && !gtk_widget_get_visible (dialog->more_row) &&
+      dialog->populate_id == 0 && dialog->update_id == 0)
+    dialog->update_id = g_timeout_add (UPDATE_CHOICES_DELAY, update_rows, dialog);
 }
@@ -27,6 +27,11 @@ struct _AppChooserRow {
   GAppInfo *info;
   gboolean selected;
 
+  GCancellable *cancellable;
+  GIcon *loading_icon;
+  int loading_scale;
+  guint loading_serial;
+
   GtkWidget *icon;
   GtkWidget *name;
   GtkWidget *check;
@@ -38,18 +43,120 @@ struct _AppChooserRowClass {
 
 G_DEFINE_TYPE (AppChooserRow, app_chooser_row, GTK_TYPE_LIST_BOX_ROW)
 
+#define ICON_SIZE 32
+#define ICON_CACHE_MAX_ENTRIES 128
+
+/* Rendered icons, shared by all rows, so that opening the chooser
+ * again for the same handful of apps doesn't go to the icon theme.
+ */
+typedef struct {
+  GIcon *icon;
+  int scale;
+} IconKey;
+
+static GHashTable *icon_cache;
+static guint icon_cache_serial;
+
+static guint
+icon_key_hash (gconstpointer data)
+{
+  const IconKey *key = data;
+
+  return g_icon_hash ((gpointer) key->icon) ^ key->scale;
+}
+
+static gboolean
+icon_key_equal (gconstpointer a,
+                gconstpointer b)
+{
+  const IconKey *ka = a;
+  const IconKey *kb = b;
+
+  return ka->scale == kb->scale && g_icon_equal (ka->icon, kb->icon);
+}
+
+static void
+icon_key_free (gpointer data)
+{
+  IconKey *key = data;
+
+  g_object_unref (key->icon);
+  g_free (key);
+}
+
+static void
+icon_theme_changed (GtkIconTheme *theme,
+                    gpointer data)
+{
+  g_hash_table_remove_all (icon_cache);
+  icon_cache_serial++;
+}
+
+static void
+ensure_icon_cache (void)
+{
+  if (icon_cache)
+    return;
+
+  icon_cache = g_hash_table_new_full (icon_key_hash, icon_key_equal,
+                                      icon_key_free,
+                                      (GDestroyNotify) cairo_surface_destroy);
+  g_signal_connect (gtk_icon_theme_get_default (), "changed",
+                    G_CALLBACK (icon_theme_changed), NULL);
+}
+
+static cairo_surface_t *
+icon_cache_lookup (GIcon *icon,
+                   int scale)
+{
+  IconKey key = { icon, scale };
+
+  return g_hash_table_lookup (icon_cache, &key);
+}
+
+static void
+icon_cache_insert (GIcon *icon,
+                   int scale,
+                   cairo_surface_t *surface)
+{
+  IconKey *key;
+
+  /* Not worth an LRU, the working set is small */
+  if (g_hash_table_size (icon_cache) >= ICON_CACHE_MAX_ENTRIES)
+    g_hash_table_remove_all (icon_cache);
+
+  key = g_new (IconKey, 1);
+  key->icon = g_object_ref (icon);
+  key->scale = scale;
+
+  g_hash_table_replace (icon_cache, key, cairo_surface_reference (surface));
+}
+
 static void
 app_chooser_row_init (AppChooserRow *row)
 {
   gtk_widget_init_template (GTK_WIDGET (row));
 }
 
+static void
+app_chooser_row_dispose (GObject *object)
+{
+  AppChooserRow *row = APP_CHOOSER_ROW (object);
+
+  if (row->cancellable)
+    g_cancellable_cancel (row->cancellable);
+  g_clear_object (&row->cancellable);
+
+  G_OBJECT_CLASS (app_chooser_row_parent_class)->dispose (object);
+}
+
 static void
 app_chooser_row_finalize (GObject *object)
 {
   AppChooserRow *row = APP_CHOOSER_ROW (object);
 
   g_clear_object (&row->info);
+  g_clear_object (&row->loading_icon);
 
   G_OBJECT_CLASS (app_chooser_row_parent_class)->finalize (object);
 }
@@ -60,6 +167,7 @@ app_chooser_row_class_init (AppChooserRowClass *class)
   GObjectClass *object_class = G_OBJECT_CLASS (class);
   GtkWidgetClass *widget_class = GTK_WIDGET_CLASS (class);
 
+  object_class->dispose = app_chooser_row_dispose;
   object_class->finalize = app_chooser_row_finalize;
 
   gtk_widget_class_set_template_from_resource (widget_class, "/org/freedesktop/portal/desktop/gtk/appchooserrow.ui");
@@ -68,24 +176,115 @@ app_chooser_row_class_init (AppChooserRowClass *class)
   gtk_widget_class_bind_template_child (widget_class, AppChooserRow, check);
 }
 
+static void
+icon_loaded (GObject *source,
+             GAsyncResult *result,
+             gpointer data)
+{
+  AppChooserRow *row = data;
+  g_autoptr(GdkPixbuf) pixbuf = NULL;
+  g_autoptr(GError) error = NULL;
+  cairo_surface_t *surface;
+
+  pixbuf = gtk_icon_info_load_icon_finish (GTK_ICON_INFO (source), result, &error);
+  if (!pixbuf)
+    {
+      if (!g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+        g_debug ("Failed to load app icon: %s", error->message);
+      return;
+    }
+
+  surface = gdk_cairo_surface_create_from_pixbuf (pixbuf, row->loading_scale, NULL);
+  gtk_image_set_from_surface (GTK_IMAGE (row->icon), surface);
+
+  /* Don't cache icons from a theme that has gone away in the meantime */
+  if (row->loading_serial == icon_cache_serial)
+    icon_cache_insert (row->loading_icon, row->loading_scale, surface);
+
+  cairo_surface_destroy (surface);
+}
+
+/* Looking up the icon in the theme is cheap, decoding it is not, so
+ * that part happens in a thread while the row is already shown.
+ */
+static void
+load_icon (AppChooserRow *row)
+{
+  g_autoptr(GIcon) fallback = NULL;
+  g_autoptr(GtkIconInfo) icon_info = NULL;
+  GIcon *icon = NULL;
+  cairo_surface_t *surface;
+  int scale;
+
+  if (row->cancellable)
+    g_cancellable_cancel (row->cancellable);
+  g_clear_object (&row->cancellable);
+
+  if (row->info)
+    icon = g_app_info_get_icon (row->info);
+  if (!icon)
+    icon = fallback = g_themed_icon_new ("application-x-executable");
+
+  scale = gtk_widget_get_scale_factor (GTK_WIDGET (row));
+
+  surface = icon_cache_lookup (icon, scale);
+  if (surface)
+    {
+      gtk_image_set_from_surface (GTK_IMAGE (row->icon), surface);
+      return;
+    }
+
+  icon_info = gtk_icon_theme_lookup_by_gicon_for_scale (gtk_icon_theme_get_default (),
+                                                        icon,
+                                                        ICON_SIZE,
+                                                        scale,
+                                                        GTK_ICON_LOOKUP_FORCE_SIZE);
+  if (!icon_info)
+    return;
+
+  g_set_object (&row->loading_icon, icon);
+  row->loading_scale = scale;
+  row->loading_serial = icon_cache_serial;
+
+  row->cancellable = g_cancellable_new ();
+  gtk_icon_info_load_icon_async (icon_info, row->cancellable, icon_loaded, row);
+}
+
+static void
+scale_factor_changed (AppChooserRow *row,
+                      GParamSpec *pspec,
+                      gpointer data)
+{
+  load_icon (row);
+}
+
+static void
+theme_changed (AppChooserRow *row)
+{
+  load_icon (row);
+}
+
 AppChooserRow *
 app_chooser_row_new (GAppInfo *info)
 {
   AppChooserRow *row;
-  GIcon *icon;
+
+  ensure_icon_cache ();
 
   row = g_object_new (app_chooser_row_get_type (), NULL);
 
   g_set_object (&row->info, info);
 
-  icon = g_app_info_get_icon (info);
-  if (!icon)
-    icon = g_themed_icon_new ("application-x-executable");
-
-  gtk_image_set_from_gicon (GTK_IMAGE (row->icon), icon, GTK_ICON_SIZE_DIALOG);
-  gtk_image_set_pixel_size (GTK_IMAGE (row->icon), 32);
+  /* Reserve the space so the row doesn't grow when the icon arrives */
+  gtk_widget_set_size_request (row->icon, ICON_SIZE, ICON_SIZE);
   gtk_label_set_label (GTK_LABEL (row->name), g_app_info_get_name (info));
 
+  load_icon (row);
+  g_signal_connect (row, "notify::scale-factor", G_CALLBACK (scale_factor_changed), NULL);
+  /* Connected after the cache's own handler, so this reloads from disk */
+  g_signal_connect_object (gtk_icon_theme_get_default (), "changed",
+                           G_CALLBACK (theme_changed), row, G_CONNECT_SWAPPED);
+
   return row;
 }
 
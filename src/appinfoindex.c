@@ -0,0 +1,148 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include <gio/gio.h>
+#include <gio/gdesktopappinfo.h>
+
+#include "appinfoindex.h"
+
+/* g_desktop_app_info_new() searches the XDG data dirs and parses the
+ * desktop file each time it is called, and the app chooser calls it for
+ * every choice. Instead, all desktop files are loaded once, in a
+ * thread, and kept by id until GAppInfoMonitor says something changed.
+ * Until the index is ready, lookups fall back to loading the file.
+ */
+
+static GHashTable *app_infos;
+static GAppInfoMonitor *monitor;
+static gboolean building;
+static guint generation;
+
+static void
+build_index_thread (GTask *task,
+                    gpointer source_object,
+                    gpointer task_data,
+                    GCancellable *cancellable)
+{
+  GHashTable *infos;
+  GList *all, *l;
+
+  infos = g_hash_table_new_full (g_str_hash, g_str_equal, NULL, g_object_unref);
+
+  all = g_app_info_get_all ();
+  for (l = all; l; l = l->next)
+    {
+      GAppInfo *info = l->data;
+      const char *id = g_app_info_get_id (info);
+
+      /* Fill in the bits the rows need while we are off the main thread */
+      g_app_info_get_name (info);
+      g_app_info_get_icon (info);
+
+      if (id != NULL && !g_hash_table_contains (infos, id))
+        g_hash_table_insert (infos, (gpointer) id, info);
+      else
+        g_object_unref (info);
+    }
+  g_list_free (all);
+
+  g_task_return_pointer (task, infos, (GDestroyNotify) g_hash_table_unref);
+}
+
+static void
+index_built (GObject *source,
+             GAsyncResult *result,
+             gpointer data)
+{
+  GHashTable *infos;
+
+  infos = g_task_propagate_pointer (G_TASK (result), NULL);
+
+  building = FALSE;
+
+  /* Something changed while we were building, try again */
+  if (GPOINTER_TO_UINT (data) != generation)
+    {
+      g_hash_table_unref (infos);
+      app_info_index_ensure ();
+      return;
+    }
+
+  g_clear_pointer (&app_infos, g_hash_table_unref);
+  app_infos = infos;
+
+  g_debug ("Indexed %u desktop files", g_hash_table_size (app_infos));
+}
+
+static void
+apps_changed (GAppInfoMonitor *monitor,
+              gpointer data)
+{
+  g_debug ("Desktop files changed, rebuilding index");
+
+  generation++;
+  g_clear_pointer (&app_infos, g_hash_table_unref);
+  app_info_index_ensure ();
+}
+
+void
+app_info_index_ensure (void)
+{
+  g_autoptr(GTask) task = NULL;
+
+  if (monitor == NULL)
+    {
+      monitor = g_app_info_monitor_get ();
+      g_signal_connect (monitor, "changed", G_CALLBACK (apps_changed), NULL);
+    }
+
+  if (app_infos || building)
+    return;
+
+  building = TRUE;
+
+  task = g_task_new (NULL, NULL, index_built, GUINT_TO_POINTER (generation));
+  g_task_set_source_tag (task, app_info_index_ensure);
+  g_task_run_in_thread (task, build_index_thread);
+}
+
+gboolean
+app_info_index_is_ready (void)
+{
+  return app_infos != NULL;
+}
+
+/* Returns a new reference, or NULL. app_id is without .desktop */
+GAppInfo *
+app_info_index_lookup (const char *app_id)
+{
+  g_autofree char *desktop_id = NULL;
+  GAppInfo *info;
+
+  desktop_id = g_strconcat (app_id, ".desktop", NULL);
+
+  if (app_infos)
+    {
+      info = g_hash_table_lookup (app_infos, desktop_id);
+      if (info)
+        return g_object_ref (info);
+    }
+  else
+    app_info_index_ensure ();
+
+  return (GAppInfo *) g_desktop_app_info_new (desktop_id);
+}
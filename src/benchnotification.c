@@ -0,0 +1,530 @@
+/* Throughput benchmark for the org.freedesktop.Notifications code in
+ * fdonotification.c.
+ *
+ * A scripted stand-in for the notification server is exported on a private
+ * bus. Notifications are added in bursts, mixing text-only, themed icon and
+ * bytes icon payloads, then the server floods the client with ActionInvoked
+ * and NotificationClosed signals, and finally the rest is removed again.
+ */
+
+#include "config.h"
+
+#include <sys/resource.h>
+
+#include <gtk/gtk.h>
+#include <gio/gio.h>
+
+#include "fdonotification.h"
+
+static const char server_xml[] =
+  "<node>"
+  "  <interface name='org.freedesktop.Notifications'>"
+  "    <method name='Notify'>"
+  "      <arg type='s' direction='in'/>"
+  "      <arg type='u' direction='in'/>"
+  "      <arg type='s' direction='in'/>"
+  "      <arg type='s' direction='in'/>"
+  "      <arg type='s' direction='in'/>"
+  "      <arg type='as' direction='in'/>"
+  "      <arg type='a{sv}' direction='in'/>"
+  "      <arg type='i' direction='in'/>"
+  "      <arg type='u' direction='out'/>"
+  "    </method>"
+  "    <method name='CloseNotification'>"
+  "      <arg type='u' direction='in'/>"
+  "    </method>"
+  "    <method name='GetCapabilities'>"
+  "      <arg type='as' direction='out'/>"
+  "    </method>"
+  "    <method name='GetServerInformation'>"
+  "      <arg type='s' direction='out'/>"
+  "      <arg type='s' direction='out'/>"
+  "      <arg type='s' direction='out'/>"
+  "      <arg type='s' direction='out'/>"
+  "    </method>"
+  "    <signal name='NotificationClosed'>"
+  "      <arg type='u'/>"
+  "      <arg type='u'/>"
+  "    </signal>"
+  "    <signal name='ActionInvoked'>"
+  "      <arg type='u'/>"
+  "      <arg type='s'/>"
+  "    </signal>"
+  "  </interface>"
+  "</node>";
+
+static int opt_count = 5000;
+static int opt_apps = 100;
+static int opt_burst = 250;
+
+static GOptionEntry entries[] = {
+  { "count", 'n', 0, G_OPTION_ARG_INT, &opt_count, "Number of notifications", "N" },
+  { "apps", 'a', 0, G_OPTION_ARG_INT, &opt_apps, "Number of apps to spread them over", "N" },
+  { "burst", 'b', 0, G_OPTION_ARG_INT, &opt_burst, "Notifications added per main loop iteration", "N" },
+  { NULL }
+};
+
+static GDBusConnection *server;
+static GDBusConnection *client;
+static gboolean server_name_acquired;
+
+/* Server side bookkeeping */
+static guint32 next_notify_id;
+static GHashTable *live_ids;
+static guint n_notify_calls;
+static guint n_close_calls;
+
+/* Client side bookkeeping */
+static guint n_activated;
+static gboolean sync_done;
+
+/* Main loop stalls, as seen by a 1ms timeout */
+static gint64 last_tick;
+static gint64 max_stall;
+static gint64 total_stall;
+
+/* Time spent inside fdo_add_notification() and fdo_remove_notification() */
+static gint64 max_call;
+
+static gboolean
+stall_probe (gpointer data)
+{
+  gint64 now = g_get_monotonic_time ();
+  gint64 late;
+
+  late = now - last_tick - 1000;
+  if (late > 1000)
+    {
+      total_stall += late;
+      max_stall = MAX (max_stall, late);
+    }
+  last_tick = now;
+
+  return G_SOURCE_CONTINUE;
+}
+
+static void
+handle_method_call (GDBusConnection *connection,
+                    const char *sender,
+                    const char *object_path,
+                    const char *interface_name,
+                    const char *method_name,
+                    GVariant *parameters,
+                    GDBusMethodInvocation *invocation,
+                    gpointer user_data)
+{
+  if (g_str_equal (method_name, "Notify"))
+    {
+      guint32 replaces_id;
+      guint32 id;
+
+      g_variant_get_child (parameters, 1, "u", &replaces_id);
+      id = replaces_id != 0 ? replaces_id : ++next_notify_id;
+      g_hash_table_add (live_ids, GUINT_TO_POINTER (id));
+      n_notify_calls++;
+
+      g_dbus_method_invocation_return_value (invocation, g_variant_new ("(u)", id));
+    }
+  else if (g_str_equal (method_name, "CloseNotification"))
+    {
+      guint32 id;
+
+      g_variant_get (parameters, "(u)", &id);
+      n_close_calls++;
+
+      if (g_hash_table_remove (live_ids, GUINT_TO_POINTER (id)))
+        g_dbus_connection_emit_signal (connection, NULL,
+                                       "/org/freedesktop/Notifications",
+                                       "org.freedesktop.Notifications",
+                                       "NotificationClosed",
+                                       g_variant_new ("(uu)", id, 3),
+                                       NULL);
+
+      g_dbus_method_invocation_return_value (invocation, NULL);
+    }
+  else if (g_str_equal (method_name, "GetCapabilities"))
+    {
+      const char *caps[] = { "actions", "body", "body-markup", "icon-static", NULL };
+
+      g_dbus_method_invocation_return_value (invocation,
+                                             g_variant_new ("(^as)", caps));
+    }
+  else if (g_str_equal (method_name, "GetServerInformation"))
+    {
+      g_dbus_method_invocation_return_value (invocation,
+                                             g_variant_new ("(ssss)",
+                                                            "benchnotification",
+                                                            "xdg-desktop-portal-gtk",
+                                                            PACKAGE_VERSION,
+                                                            "1.2"));
+    }
+}
+
+static const GDBusInterfaceVTable server_vtable = {
+  handle_method_call,
+  NULL,
+  NULL,
+};
+
+static void
+name_acquired (GDBusConnection *connection,
+               const char *name,
+               gpointer user_data)
+{
+  server_name_acquired = TRUE;
+}
+
+static void
+activate_action (GDBusConnection *connection,
+                 const char *app_id,
+                 const char *id,
+                 const char *name,
+                 GVariant *parameter,
+                 const char *activation_token,
+                 gpointer data)
+{
+  n_activated++;
+}
+
+static gboolean
+wait_for (gboolean *condition)
+{
+  gint64 end = g_get_monotonic_time () + 60 * G_USEC_PER_SEC;
+
+  while (!*condition)
+    {
+      if (g_get_monotonic_time () > end)
+        return FALSE;
+      g_main_context_iteration (NULL, TRUE);
+    }
+
+  return TRUE;
+}
+
+static void
+sync_reply (GObject *source_object,
+            GAsyncResult *result,
+            gpointer user_data)
+{
+  g_autoptr(GVariant) ret = NULL;
+
+  ret = g_dbus_connection_call_finish (G_DBUS_CONNECTION (source_object), result, NULL);
+  sync_done = TRUE;
+}
+
+/* Make a round trip from the client to the server. Anything the server
+ * sent before replying has been queued by the time the reply arrives.
+ */
+static void
+sync_with_server (void)
+{
+  sync_done = FALSE;
+  g_dbus_connection_call (client,
+                          "org.freedesktop.Notifications",
+                          "/org/freedesktop/Notifications",
+                          "org.freedesktop.Notifications",
+                          "GetServerInformation",
+                          NULL, NULL,
+                          G_DBUS_CALL_FLAGS_NONE,
+                          -1, NULL,
+                          sync_reply, NULL);
+  wait_for (&sync_done);
+
+  while (g_main_context_iteration (NULL, FALSE))
+    ;
+}
+
+static GBytes *
+make_png (void)
+{
+  g_autoptr(GdkPixbuf) pixbuf = NULL;
+  gchar *buffer;
+  gsize size;
+
+  pixbuf = gdk_pixbuf_new (GDK_COLORSPACE_RGB, TRUE, 8, 256, 256);
+  gdk_pixbuf_fill (pixbuf, 0x3465a4ff);
+  gdk_pixbuf_save_to_buffer (pixbuf, &buffer, &size, "png", NULL, NULL);
+
+  return g_bytes_new_take (buffer, size);
+}
+
+static GVariant *
+make_notification (guint i,
+                   GBytes *png)
+{
+  GVariantBuilder builder;
+  g_autoptr(GIcon) icon = NULL;
+  g_autoptr(GVariant) serialized = NULL;
+  g_autofree char *title = NULL;
+
+  title = g_strdup_printf ("Notification %u", i);
+
+  g_variant_builder_init (&builder, G_VARIANT_TYPE_VARDICT);
+  g_variant_builder_add (&builder, "{sv}", "title", g_variant_new_string (title));
+  g_variant_builder_add (&builder, "{sv}", "body", g_variant_new_string ("Something happened & it was benchmarked"));
+  g_variant_builder_add (&builder, "{sv}", "default-action", g_variant_new_string ("app.activate"));
+  g_variant_builder_add (&builder, "{sv}", "default-action-target", g_variant_new_uint32 (i));
+
+  switch (i % 3)
+    {
+    case 1:
+      icon = g_themed_icon_new ("dialog-information");
+      break;
+    case 2:
+      icon = g_bytes_icon_new (png);
+      break;
+    default:
+      break;
+    }
+
+  if (icon)
+    {
+      serialized = g_icon_serialize (icon);
+      g_variant_builder_add (&builder, "{sv}", "icon", serialized);
+    }
+
+  return g_variant_ref_sink (g_variant_builder_end (&builder));
+}
+
+static char *
+app_id_for (guint i)
+{
+  return g_strdup_printf ("org.example.BenchApp%u", i % opt_apps);
+}
+
+static void
+report (const char *phase,
+        guint count,
+        gint64 start)
+{
+  double elapsed = (g_get_monotonic_time () - start) / (double) G_USEC_PER_SEC;
+
+  g_print ("%-10s %8u %10.1f %12.0f %12" G_GINT64_FORMAT " %12" G_GINT64_FORMAT " %10" G_GINT64_FORMAT "\n",
+           phase, count, elapsed * 1000,
+           elapsed > 0 ? count / elapsed : 0,
+           max_call, max_stall / 1000, total_stall / 1000);
+
+  max_call = 0;
+  max_stall = 0;
+  total_stall = 0;
+}
+
+static void
+add_notifications (GBytes *png)
+{
+  gint64 start;
+  guint i;
+
+  start = g_get_monotonic_time ();
+
+  for (i = 0; i < (guint) opt_count; i++)
+    {
+      g_autoptr(GVariant) notification = NULL;
+      g_autofree char *app_id = NULL;
+      g_autofree char *id = NULL;
+      gint64 call_start;
+
+      notification = make_notification (i, png);
+      app_id = app_id_for (i);
+      id = g_strdup_printf ("n%u", i);
+
+      call_start = g_get_monotonic_time ();
+      fdo_add_notification (client, app_id, id, notification, activate_action, NULL);
+      max_call = MAX (max_call, g_get_monotonic_time () - call_start);
+
+      if ((i + 1) % opt_burst == 0)
+        while (g_main_context_iteration (NULL, FALSE))
+          ;
+    }
+
+  while (n_notify_calls < (guint) opt_count)
+    g_main_context_iteration (NULL, TRUE);
+
+  sync_with_server ();
+
+  report ("add", opt_count, start);
+}
+
+static void
+signal_storm (void)
+{
+  g_autoptr(GList) ids = NULL;
+  gint64 start;
+  guint n_signals = 0;
+  GList *l;
+
+  ids = g_hash_table_get_keys (live_ids);
+
+  start = g_get_monotonic_time ();
+
+  /* Activate a third of the notifications, close another third, and
+   * throw in signals for ids the client has never heard of.
+   */
+  for (l = ids; l != NULL; l = l->next)
+    {
+      guint32 id = GPOINTER_TO_UINT (l->data);
+
+      if (id % 3 == 0)
+        {
+          g_dbus_connection_emit_signal (server, NULL,
+                                         "/org/freedesktop/Notifications",
+                                         "org.freedesktop.Notifications",
+                                         "ActionInvoked",
+                                         g_variant_new ("(us)", id, "default"),
+                                         NULL);
+          g_dbus_connection_emit_signal (server, NULL,
+                                         "/org/freedesktop/Notifications",
+                                         "org.freedesktop.Notifications",
+                                         "NotificationClosed",
+                                         g_variant_new ("(uu)", id, 2),
+                                         NULL);
+          g_hash_table_remove (live_ids, l->data);
+          n_signals += 2;
+        }
+      else if (id % 3 == 1)
+        {
+          g_dbus_connection_emit_signal (server, NULL,
+                                         "/org/freedesktop/Notifications",
+                                         "org.freedesktop.Notifications",
+                                         "NotificationClosed",
+                                         g_variant_new ("(uu)", id, 1),
+                                         NULL);
+          g_hash_table_remove (live_ids, l->data);
+          n_signals++;
+        }
+
+      g_dbus_connection_emit_signal (server, NULL,
+                                     "/org/freedesktop/Notifications",
+                                     "org.freedesktop.Notifications",
+                                     "NotificationClosed",
+                                     g_variant_new ("(uu)", G_MAXUINT32 - id, 1),
+                                     NULL);
+      n_signals++;
+    }
+
+  sync_with_server ();
+
+  report ("signals", n_signals, start);
+}
+
+static void
+remove_notifications (void)
+{
+  gint64 start;
+  guint n_removed = 0;
+  guint i;
+
+  start = g_get_monotonic_time ();
+
+  for (i = 0; i < (guint) opt_count; i++)
+    {
+      g_autofree char *app_id = NULL;
+      g_autofree char *id = NULL;
+      gint64 call_start;
+
+      app_id = app_id_for (i);
+      id = g_strdup_printf ("n%u", i);
+
+      call_start = g_get_monotonic_time ();
+      if (fdo_remove_notification (client, app_id, id))
+        n_removed++;
+      max_call = MAX (max_call, g_get_monotonic_time () - call_start);
+
+      if ((i + 1) % opt_burst == 0)
+        while (g_main_context_iteration (NULL, FALSE))
+          ;
+    }
+
+  sync_with_server ();
+
+  report ("remove", n_removed, start);
+}
+
+int
+main (int argc, char *argv[])
+{
+  g_autoptr(GOptionContext) context = NULL;
+  g_autoptr(GError) error = NULL;
+  g_autoptr(GTestDBus) dbus = NULL;
+  g_autoptr(GDBusNodeInfo) info = NULL;
+  g_autoptr(GBytes) png = NULL;
+  FdoNotificationStats stats;
+  struct rusage usage;
+  const char *address;
+
+  context = g_option_context_new ("- benchmark the notification backend");
+  g_option_context_add_main_entries (context, entries, NULL);
+  if (!g_option_context_parse (context, &argc, &argv, &error))
+    {
+      g_printerr ("%s\n", error->message);
+      return 1;
+    }
+
+  opt_apps = MAX (opt_apps, 1);
+  opt_burst = MAX (opt_burst, 1);
+
+  dbus = g_test_dbus_new (G_TEST_DBUS_NONE);
+  g_test_dbus_up (dbus);
+  address = g_test_dbus_get_bus_address (dbus);
+
+  server = g_dbus_connection_new_for_address_sync (address,
+                                                   G_DBUS_CONNECTION_FLAGS_AUTHENTICATION_CLIENT |
+                                                   G_DBUS_CONNECTION_FLAGS_MESSAGE_BUS_CONNECTION,
+                                                   NULL, NULL, &error);
+  if (server)
+    client = g_dbus_connection_new_for_address_sync (address,
+                                                     G_DBUS_CONNECTION_FLAGS_AUTHENTICATION_CLIENT |
+                                                     G_DBUS_CONNECTION_FLAGS_MESSAGE_BUS_CONNECTION,
+                                                     NULL, NULL, &error);
+  if (client == NULL)
+    {
+      g_printerr ("Could not connect to the private bus: %s\n", error->message);
+      g_test_dbus_down (dbus);
+      return 1;
+    }
+
+  info = g_dbus_node_info_new_for_xml (server_xml, NULL);
+  g_dbus_connection_register_object (server,
+                                     "/org/freedesktop/Notifications",
+                                     info->interfaces[0],
+                                     &server_vtable,
+                                     NULL, NULL, NULL);
+  g_bus_own_name_on_connection (server,
+                                "org.freedesktop.Notifications",
+                                G_BUS_NAME_OWNER_FLAGS_NONE,
+                                name_acquired, NULL,
+                                NULL, NULL);
+  wait_for (&server_name_acquired);
+
+  live_ids = g_hash_table_new (NULL, NULL);
+  png = make_png ();
+
+  last_tick = g_get_monotonic_time ();
+  g_timeout_add (1, stall_probe, NULL);
+
+  g_print ("%-10s %8s %10s %12s %12s %12s %10s\n",
+           "phase", "count", "ms", "per second", "max call us", "max stall ms", "stalled ms");
+
+  add_notifications (png);
+  signal_storm ();
+  remove_notifications ();
+
+  fdo_get_notification_stats (&stats);
+  getrusage (RUSAGE_SELF, &usage);
+
+  g_print ("\n");
+  g_print ("server Notify calls:        %u\n", n_notify_calls);
+  g_print ("server CloseNotification:   %u\n", n_close_calls);
+  g_print ("actions activated:          %u\n", n_activated);
+  g_print ("notifications left:         %u\n", stats.n_notifications);
+  g_print ("evicted (app limit):        %" G_GUINT64_FORMAT "\n", stats.n_evicted_app_limit);
+  g_print ("evicted (global limit):     %" G_GUINT64_FORMAT "\n", stats.n_evicted_global_limit);
+  g_print ("expired:                    %" G_GUINT64_FORMAT "\n", stats.n_expired);
+  g_print ("peak memory:                %ld KiB\n", usage.ru_maxrss);
+
+  g_object_unref (client);
+  g_object_unref (server);
+  g_test_dbus_down (dbus);
+
+  return 0;
+}
@@ -0,0 +1,624 @@
+/* Stall benchmark for print document ingestion in print.c.
+ *
+ * The Print and Settings backends are exported on a private bus, with
+ * GTK restricted to its print-to-file backend. For each document size a
+ * PreparePrint dialog is answered automatically to get a token, then the
+ * document is printed through the token path of Print. While that
+ * happens, a 1ms timeout measures main loop stalls and a Settings.Read
+ * call is issued every 10ms to see how long other portals have to wait.
+ */
+
+#include "config.h"
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+
+#include <gtk/gtk.h>
+#include <gtk/gtkunixprint.h>
+#include <gio/gio.h>
+#include <gio/gunixfdlist.h>
+
+#include "print.h"
+#include "settings.h"
+#include "utils.h"
+
+#include "gtkbackports.h"
+
+#define APP_ID "org.example.BenchPrint"
+#define MB (1024 * 1024)
+
+static int opt_min_size = 1;
+static int opt_max_size = 2048;
+static gboolean opt_pipe;
+static char *opt_dir;
+
+static GOptionEntry entries[] = {
+  { "min-size", 0, 0, G_OPTION_ARG_INT, &opt_min_size, "Size of the smallest document in MiB", "N" },
+  { "max-size", 0, 0, G_OPTION_ARG_INT, &opt_max_size, "Size of the largest document in MiB", "N" },
+  { "pipe", 'p', 0, G_OPTION_ARG_NONE, &opt_pipe, "Pass documents through a pipe instead of a file", NULL },
+  { "dir", 'd', 0, G_OPTION_ARG_FILENAME, &opt_dir, "Where to put documents and printed output", "DIR" },
+  { NULL }
+};
+
+static GDBusConnection *portal;
+static GDBusConnection *client;
+static const char *portal_name;
+
+/* Main loop stalls, as seen by a 1ms timeout */
+static gint64 last_tick;
+static gint64 max_stall;
+static gint64 total_stall;
+
+/* Settings.Read round trips, issued every 10ms */
+static guint n_reads;
+static gint64 max_read;
+
+/* Spool usage on disk and in memfds, on top of the printed output */
+static const char *output_path;
+static guint64 baseline_usage;
+static guint64 peak_usage;
+
+static gboolean
+stall_probe (gpointer data)
+{
+  gint64 now = g_get_monotonic_time ();
+  gint64 late;
+
+  late = now - last_tick - 1000;
+  if (late > 1000)
+    {
+      total_stall += late;
+      max_stall = MAX (max_stall, late);
+    }
+  last_tick = now;
+
+  return G_SOURCE_CONTINUE;
+}
+
+/* memfd spools don't show up on any filesystem, but the portal runs
+ * in this process, so they can be found among our own fds.
+ */
+static guint64
+memfd_usage (void)
+{
+  GDir *dir;
+  const char *name;
+  guint64 used = 0;
+
+  dir = g_dir_open ("/proc/self/fd", 0, NULL);
+  if (dir == NULL)
+    return 0;
+
+  while ((name = g_dir_read_name (dir)) != NULL)
+    {
+      g_autofree char *path = g_build_filename ("/proc/self/fd", name, NULL);
+      g_autofree char *target = g_file_read_link (path, NULL);
+      struct stat st;
+
+      if (target == NULL || !g_str_has_prefix (target, "/memfd:"))
+        continue;
+
+      if (fstat (atoi (name), &st) == 0)
+        used += (guint64) st.st_blocks * 512;
+    }
+
+  g_dir_close (dir);
+
+  return used;
+}
+
+static guint64
+spool_usage (void)
+{
+  const char *dirs[] = { g_get_tmp_dir (), g_get_user_runtime_dir () };
+  unsigned long fsids[G_N_ELEMENTS (dirs)];
+  guint64 used = 0;
+  struct stat st;
+  gsize i, j;
+
+  for (i = 0; i < G_N_ELEMENTS (dirs); i++)
+    {
+      struct statvfs buf;
+
+      fsids[i] = 0;
+      if (statvfs (dirs[i], &buf) != 0)
+        continue;
+
+      fsids[i] = buf.f_fsid;
+      for (j = 0; j < i; j++)
+        if (fsids[j] == buf.f_fsid)
+          break;
+
+      if (j == i)
+        used += (guint64) (buf.f_blocks - buf.f_bfree) * buf.f_frsize;
+    }
+
+  if (output_path && stat (output_path, &st) == 0)
+    used -= MIN (used, (guint64) st.st_blocks * 512);
+
+  return used + memfd_usage ();
+}
+
+static void
+read_reply (GObject *source_object,
+            GAsyncResult *result,
+            gpointer user_data)
+{
+  g_autofree gint64 *start = user_data;
+  g_autoptr(GVariant) ret = NULL;
+
+  /* An error reply is as good as any for measuring the round trip */
+  ret = g_dbus_connection_call_finish (G_DBUS_CONNECTION (source_object), result, NULL);
+
+  n_reads++;
+  max_read = MAX (max_read, g_get_monotonic_time () - *start);
+}
+
+static gboolean
+read_probe (gpointer data)
+{
+  gint64 *start;
+
+  start = g_new (gint64, 1);
+  *start = g_get_monotonic_time ();
+
+  g_dbus_connection_call (client,
+                          portal_name,
+                          DESKTOP_PORTAL_OBJECT_PATH,
+                          "org.freedesktop.impl.portal.Settings",
+                          "Read",
+                          g_variant_new ("(ss)", "org.gnome.desktop.interface", "gtk-theme"),
+                          NULL,
+                          G_DBUS_CALL_FLAGS_NONE,
+                          -1, NULL,
+                          read_reply, start);
+
+  peak_usage = MAX (peak_usage, spool_usage ());
+
+  return G_SOURCE_CONTINUE;
+}
+
+static void
+reset_probes (void)
+{
+  max_stall = 0;
+  total_stall = 0;
+  n_reads = 0;
+  max_read = 0;
+  baseline_usage = spool_usage ();
+  peak_usage = baseline_usage;
+}
+
+static gboolean
+wait_for (gboolean *condition)
+{
+  gint64 end = g_get_monotonic_time () + 600 * G_USEC_PER_SEC;
+
+  while (!*condition)
+    {
+      if (g_get_monotonic_time () > end)
+        return FALSE;
+      g_main_context_iteration (NULL, TRUE);
+    }
+
+  return TRUE;
+}
+
+static gboolean
+find_file_printer (GtkPrinter *printer,
+                   gpointer data)
+{
+  char **name = data;
+
+  *name = g_strdup (gtk_printer_get_name (printer));
+
+  return TRUE;
+}
+
+static GtkWidget *
+find_print_dialog (void)
+{
+  g_autoptr(GList) toplevels = NULL;
+  GList *l;
+
+  toplevels = gtk_window_list_toplevels ();
+  for (l = toplevels; l; l = l->next)
+    {
+      if (GTK_IS_PRINT_UNIX_DIALOG (l->data) && gtk_widget_get_visible (l->data))
+        return l->data;
+    }
+
+  return NULL;
+}
+
+typedef struct {
+  gboolean done;
+  GVariant *ret;
+  GUnixFDList *fd_list;
+  GError *error;
+} Call;
+
+static void
+call_reply (GObject *source_object,
+            GAsyncResult *result,
+            gpointer user_data)
+{
+  Call *call = user_data;
+
+  call->ret = g_dbus_connection_call_with_unix_fd_list_finish (G_DBUS_CONNECTION (source_object),
+                                                               &call->fd_list,
+                                                               result,
+                                                               &call->error);
+  call->done = TRUE;
+}
+
+static guint32
+prepare_print (const char *printer_name,
+               const char *output_uri,
+               guint n)
+{
+  g_autoptr(GtkPrintSettings) settings = NULL;
+  g_autoptr(GtkPageSetup) page_setup = NULL;
+  g_autoptr(GVariant) results = NULL;
+  g_autofree char *handle = NULL;
+  GVariantBuilder options;
+  Call call = { 0, };
+  guint32 response;
+  guint32 token = 0;
+  gint64 end;
+
+  settings = gtk_print_settings_new ();
+  gtk_print_settings_set_printer (settings, printer_name);
+  gtk_print_settings_set (settings, GTK_PRINT_SETTINGS_OUTPUT_URI, output_uri);
+  gtk_print_settings_set (settings, GTK_PRINT_SETTINGS_OUTPUT_FILE_FORMAT, "pdf");
+  page_setup = gtk_page_setup_new ();
+
+  handle = g_strdup_printf ("/org/freedesktop/portal/desktop/request/benchprint/prepare%u", n);
+  g_variant_builder_init (&options, G_VARIANT_TYPE_VARDICT);
+
+  g_dbus_connection_call_with_unix_fd_list (client,
+                                            portal_name,
+                                            DESKTOP_PORTAL_OBJECT_PATH,
+                                            "org.freedesktop.impl.portal.Print",
+                                            "PreparePrint",
+                                            g_variant_new ("(osss@a{sv}@a{sv}a{sv})",
+                                                           handle, APP_ID, "", "Benchmark",
+                                                           gtk_print_settings_to_gvariant (settings),
+                                                           gtk_page_setup_to_gvariant (page_setup),
+                                                           &options),
+                                            G_VARIANT_TYPE ("(ua{sv})"),
+                                            G_DBUS_CALL_FLAGS_NONE,
+                                            G_MAXINT,
+                                            NULL, NULL,
+                                            call_reply, &call);
+
+  /* Accept the dialog once it has picked up the file printer */
+  end = g_get_monotonic_time () + 60 * G_USEC_PER_SEC;
+  while (!call.done && g_get_monotonic_time () < end)
+    {
+      GtkWidget *dialog = find_print_dialog ();
+
+      if (dialog && gtk_print_unix_dialog_get_selected_printer (GTK_PRINT_UNIX_DIALOG (dialog)))
+        gtk_dialog_response (GTK_DIALOG (dialog), GTK_RESPONSE_OK);
+      else
+        g_main_context_iteration (NULL, TRUE);
+    }
+
+  if (!wait_for (&call.done) || call.ret == NULL)
+    {
+      g_printerr ("PreparePrint failed: %s\n", call.error ? call.error->message : "timed out");
+      g_clear_error (&call.error);
+      return 0;
+    }
+
+  g_variant_get (call.ret, "(u@a{sv})", &response, &results);
+  g_variant_lookup (results, "token", "u", &token);
+  g_variant_unref (call.ret);
+
+  return token;
+}
+
+static gboolean
+make_document (int fd,
+               goffset size)
+{
+  g_autofree char *buffer = NULL;
+  goffset written = 0;
+
+  buffer = g_malloc (MB);
+  memset (buffer, 'x', MB);
+  memcpy (buffer, "%PDF-1.4\n", strlen ("%PDF-1.4\n"));
+
+  while (written < size)
+    {
+      gssize n;
+
+      n = write (fd, buffer, MIN (MB, size - written));
+      if (n <= 0)
+        return FALSE;
+      written += n;
+    }
+
+  return TRUE;
+}
+
+typedef struct {
+  int fd;
+  goffset size;
+} PipeFeed;
+
+static gpointer
+feed_pipe (gpointer data)
+{
+  PipeFeed *feed = data;
+
+  make_document (feed->fd, feed->size);
+  close (feed->fd);
+  g_free (feed);
+
+  return NULL;
+}
+
+/* Returns the fd to hand to Print, a file or the read end of a pipe
+ * that is being filled from a thread.
+ */
+static int
+open_document (const char *dir,
+               goffset size)
+{
+  g_autofree char *path = NULL;
+  int fds[2];
+  int fd;
+
+  if (opt_pipe)
+    {
+      PipeFeed *feed;
+
+      if (pipe (fds) != 0)
+        return -1;
+
+      feed = g_new (PipeFeed, 1);
+      feed->fd = fds[1];
+      feed->size = size;
+      g_thread_unref (g_thread_new ("feed", feed_pipe, feed));
+
+      return fds[0];
+    }
+
+  path = g_build_filename (dir, "document.pdf", NULL);
+  fd = open (path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+  unlink (path);
+  if (fd == -1)
+    return -1;
+
+  if (!make_document (fd, size))
+    {
+      close (fd);
+      return -1;
+    }
+
+  fsync (fd);
+  lseek (fd, 0, SEEK_SET);
+
+  return fd;
+}
+
+static gboolean
+print_document (const char *dir,
+                const char *printer_name,
+                guint n,
+                goffset size)
+{
+  g_autofree char *output = NULL;
+  g_autofree char *output_uri = NULL;
+  g_autofree char *handle = NULL;
+  g_autoptr(GUnixFDList) fd_list = NULL;
+  g_autoptr(GError) error = NULL;
+  GVariantBuilder options;
+  PrintJobStats stats;
+  Call call = { 0, };
+  guint64 finished;
+  guint32 token;
+  gint64 start;
+  gint64 replied;
+  int fd;
+  int idx;
+
+  output = g_build_filename (dir, "output.pdf", NULL);
+  output_uri = g_filename_to_uri (output, NULL, NULL);
+
+  token = prepare_print (printer_name, output_uri, n);
+  if (token == 0)
+    return FALSE;
+
+  fd = open_document (dir, size);
+  if (fd == -1)
+    {
+      g_printerr ("Could not create a %" G_GOFFSET_FORMAT " byte document\n", size);
+      return FALSE;
+    }
+
+  fd_list = g_unix_fd_list_new ();
+  idx = g_unix_fd_list_append (fd_list, fd, &error);
+  close (fd);
+  if (idx == -1)
+    {
+      g_printerr ("%s\n", error->message);
+      return FALSE;
+    }
+
+  handle = g_strdup_printf ("/org/freedesktop/portal/desktop/request/benchprint/print%u", n);
+  g_variant_builder_init (&options, G_VARIANT_TYPE_VARDICT);
+  g_variant_builder_add (&options, "{sv}", "token", g_variant_new_uint32 (token));
+
+  print_get_job_stats (&stats);
+  finished = stats.n_completed + stats.n_failed;
+
+  output_path = output;
+  reset_probes ();
+  start = g_get_monotonic_time ();
+
+  g_dbus_connection_call_with_unix_fd_list (client,
+                                            portal_name,
+                                            DESKTOP_PORTAL_OBJECT_PATH,
+                                            "org.freedesktop.impl.portal.Print",
+                                            "Print",
+                                            g_variant_new ("(osssha{sv})",
+                                                           handle, APP_ID, "", "Benchmark",
+                                                           idx, &options),
+                                            G_VARIANT_TYPE ("(ua{sv})"),
+                                            G_DBUS_CALL_FLAGS_NONE,
+                                            G_MAXINT,
+                                            fd_list, NULL,
+                                            call_reply, &call);
+
+  wait_for (&call.done);
+  replied = g_get_monotonic_time ();
+
+  if (call.ret == NULL)
+    {
+      g_printerr ("Print failed: %s\n", call.error->message);
+      g_clear_error (&call.error);
+      output_path = NULL;
+      return FALSE;
+    }
+  g_variant_unref (call.ret);
+  g_clear_object (&call.fd_list);
+
+  /* The reply only says the job was queued, wait for the backend */
+  do
+    {
+      g_main_context_iteration (NULL, TRUE);
+      print_get_job_stats (&stats);
+    }
+  while (stats.n_completed + stats.n_failed == finished);
+
+  g_print ("%8" G_GOFFSET_FORMAT " %10.1f %10.1f %12.1f %10.1f %8u %10.1f\n",
+           size / MB,
+           (replied - start) / 1000.0,
+           (g_get_monotonic_time () - start) / 1000.0,
+           max_stall / 1000.0,
+           max_read / 1000.0,
+           n_reads,
+           (peak_usage - baseline_usage) / (double) MB);
+
+  output_path = NULL;
+  unlink (output);
+
+  return TRUE;
+}
+
+int
+main (int argc, char *argv[])
+{
+  g_autoptr(GOptionContext) context = NULL;
+  g_autoptr(GError) error = NULL;
+  g_autoptr(GTestDBus) dbus = NULL;
+  g_autofree char *dir = NULL;
+  g_autofree char *printer_name = NULL;
+  PrintJobStats stats;
+  struct rusage usage;
+  const char *address;
+  goffset size;
+  guint n = 0;
+
+  /* Only the print-to-file backend, no real printers needed */
+  g_setenv ("GTK_PRINT_BACKENDS", "file", TRUE);
+
+  context = g_option_context_new ("- benchmark print document ingestion");
+  g_option_context_add_main_entries (context, entries, NULL);
+  g_option_context_add_group (context, gtk_get_option_group (TRUE));
+  if (!g_option_context_parse (context, &argc, &argv, &error))
+    {
+      g_printerr ("%s\n", error->message);
+      return 1;
+    }
+
+  opt_min_size = MAX (opt_min_size, 1);
+  opt_max_size = MAX (opt_max_size, opt_min_size);
+
+  if (opt_dir)
+    dir = g_strdup (opt_dir);
+  else
+    dir = g_dir_make_tmp ("benchprintXXXXXX", &error);
+  if (dir == NULL)
+    {
+      g_printerr ("%s\n", error->message);
+      return 1;
+    }
+
+  gtk_enumerate_printers (find_file_printer, &printer_name, NULL, TRUE);
+  if (printer_name == NULL)
+    {
+      g_printerr ("The print-to-file backend is not available\n");
+      return 1;
+    }
+
+  dbus = g_test_dbus_new (G_TEST_DBUS_NONE);
+  g_test_dbus_up (dbus);
+  address = g_test_dbus_get_bus_address (dbus);
+
+  portal = g_dbus_connection_new_for_address_sync (address,
+                                                   G_DBUS_CONNECTION_FLAGS_AUTHENTICATION_CLIENT |
+                                                   G_DBUS_CONNECTION_FLAGS_MESSAGE_BUS_CONNECTION,
+                                                   NULL, NULL, &error);
+  if (portal)
+    client = g_dbus_connection_new_for_address_sync (address,
+                                                     G_DBUS_CONNECTION_FLAGS_AUTHENTICATION_CLIENT |
+                                                     G_DBUS_CONNECTION_FLAGS_MESSAGE_BUS_CONNECTION,
+                                                     NULL, NULL, &error);
+  if (client == NULL)
+    {
+      g_printerr ("Could not connect to the private bus: %s\n", error->message);
+      g_test_dbus_down (dbus);
+      return 1;
+    }
+
+  portal_name = g_dbus_connection_get_unique_name (portal);
+
+  if (!print_init (portal, &error) ||
+      !settings_init (portal, &error))
+    {
+      g_printerr ("Could not export the portals: %s\n", error->message);
+      g_test_dbus_down (dbus);
+      return 1;
+    }
+
+  last_tick = g_get_monotonic_time ();
+  g_timeout_add (1, stall_probe, NULL);
+  g_timeout_add (10, read_probe, NULL);
+
+  g_print ("%8s %10s %10s %12s %10s %8s %10s\n",
+           "MiB", "reply ms", "done ms", "max stall ms", "max read ms", "reads", "spool MiB");
+
+  for (size = (goffset) opt_min_size * MB; ; size = MIN (size * 4, (goffset) opt_max_size * MB))
+    {
+      if (!print_document (dir, printer_name, n++, size))
+        break;
+
+      if (size == (goffset) opt_max_size * MB)
+        break;
+    }
+
+  print_get_job_stats (&stats);
+  getrusage (RUSAGE_SELF, &usage);
+
+  g_print ("\n");
+  g_print ("jobs completed:             %" G_GUINT64_FORMAT "\n", stats.n_completed);
+  g_print ("jobs failed:                %" G_GUINT64_FORMAT "\n", stats.n_failed);
+  g_print ("peak memory:                %ld KiB\n", usage.ru_maxrss);
+
+  if (opt_dir == NULL)
+    rmdir (dir);
+
+  g_object_unref (client);
+  g_object_unref (portal);
+  g_test_dbus_down (dbus);
+
+  return 0;
+}
@@ -41,6 +41,14 @@
 
 #define DEFAULT_ICON_SIZE 192
 
+/* Limits for the icon the app sends, so decoding it can't take long */
+#define MAX_ICON_BYTES (4 * 1024 * 1024)
+#define MAX_ICON_DIMENSION 4096
+#define ICON_CHUNK_SIZE (64 * 1024)
+
+/* Past this, a PNG of DEFAULT_ICON_SIZE carries more than pixels */
+#define MAX_KEPT_ICON_BYTES (DEFAULT_ICON_SIZE * DEFAULT_ICON_SIZE * 4)
+
 typedef enum {
   DYNAMIC_LAUNCHER_TYPE_APPLICATION = 1,
   DYNAMIC_LAUNCHER_TYPE_WEBAPP = 2,
@@ -52,8 +60,10 @@ typedef struct {
   Request *request;
   GtkWidget *dialog;
   GtkWidget *entry;
+  GtkWidget *image;
   ExternalWindow *external_parent;
   GVariant *icon_v;
+  GCancellable *cancellable;
 
   int response;
 } InstallDialogHandle;
@@ -63,6 +73,8 @@ install_dialog_handle_free (gpointer data)
 {
   InstallDialogHandle *handle = data;
 
+  g_cancellable_cancel (handle->cancellable);
+  g_object_unref (handle->cancellable);
   g_clear_object (&handle->external_parent);
   g_object_unref (handle->request);
   if (handle->dialog)
@@ -166,6 +178,240 @@ handle_prepare_install_response (GtkDialog *dialog,
   send_prepare_install_response (handle);
 }
 
+typedef struct {
+  int width;
+  int height;
+  gboolean too_large;
+} IconHeader;
+
+typedef struct {
+  GdkPixbuf *pixbuf;
+  GVariant *icon_v; /* NULL to keep the original */
+} DecodedIcon;
+
+static void
+decoded_icon_free (gpointer data)
+{
+  DecodedIcon *decoded = data;
+
+  g_object_unref (decoded->pixbuf);
+  if (decoded->icon_v)
+    g_variant_unref (decoded->icon_v);
+  g_free (decoded);
+}
+
+static gboolean
+format_is_scalable (GdkPixbufFormat *format)
+{
+  return format != NULL && gdk_pixbuf_format_is_scalable (format);
+}
+
+static void
+icon_size_prepared (GdkPixbufLoader *loader,
+                    int              width,
+                    int              height,
+                    gpointer         data)
+{
+  IconHeader *header = data;
+  GdkPixbufFormat *format;
+  double scale;
+
+  format = gdk_pixbuf_loader_get_format (loader);
+
+  header->width = width;
+  header->height = height;
+
+  /* Vector images are rendered at the size we ask for */
+  if (width <= 0 || height <= 0 ||
+      (!format_is_scalable (format) &&
+       (width > MAX_ICON_DIMENSION || height > MAX_ICON_DIMENSION)))
+    {
+      header->too_large = TRUE;
+      gdk_pixbuf_loader_set_size (loader, 1, 1);
+      return;
+    }
+
+  /* Raster images are only ever scaled down here, scaling up for the
+   * dialog happens separately so it doesn't end up in the stored icon.
+   */
+  scale = MIN ((double) DEFAULT_ICON_SIZE / width, (double) DEFAULT_ICON_SIZE / height);
+  if (!format_is_scalable (format))
+    scale = MIN (1.0, scale);
+  gdk_pixbuf_loader_set_size (loader,
+                              MAX (1, (int) (width * scale + 0.5)),
+                              MAX (1, (int) (height * scale + 0.5)));
+}
+
+static void
+decode_icon_thread (GTask        *task,
+                    gpointer      source_object,
+                    gpointer      task_data,
+                    GCancellable *cancellable)
+{
+  GBytes *bytes = task_data;
+  g_autoptr(GdkPixbufLoader) loader = NULL;
+  GError *error = NULL;
+  IconHeader header = { 0, };
+  const guchar *data;
+  gsize size, offset;
+  GdkPixbufFormat *format;
+  DecodedIcon *decoded;
+  g_autoptr(GdkPixbuf) pixbuf = NULL;
+  g_autofree char *format_name = NULL;
+  gboolean keep_original;
+
+  loader = gdk_pixbuf_loader_new ();
+  g_signal_connect (loader, "size-prepared", G_CALLBACK (icon_size_prepared), &header);
+
+  data = g_bytes_get_data (bytes, &size);
+  for (offset = 0; offset < size; offset += ICON_CHUNK_SIZE)
+    {
+      if (g_cancellable_set_error_if_cancelled (cancellable, &error) ||
+          !gdk_pixbuf_loader_write (loader, data + offset,
+                                    MIN (ICON_CHUNK_SIZE, size - offset),
+                                    &error))
+        {
+          gdk_pixbuf_loader_close (loader, NULL);
+          g_task_return_error (task, error);
+          return;
+        }
+
+      if (header.too_large)
+        break;
+    }
+
+  if (header.too_large)
+    {
+      gdk_pixbuf_loader_close (loader, NULL);
+      g_task_return_new_error (task, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                               "Icon is larger than %dx%d pixels",
+                               MAX_ICON_DIMENSION, MAX_ICON_DIMENSION);
+      return;
+    }
+
+  if (!gdk_pixbuf_loader_close (loader, &error))
+    {
+      g_task_return_error (task, error);
+      return;
+    }
+
+  if (gdk_pixbuf_loader_get_pixbuf (loader) == NULL)
+    {
+      g_task_return_new_error (task, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                               "Icon could not be decoded");
+      return;
+    }
+
+  pixbuf = gdk_pixbuf_apply_embedded_orientation (gdk_pixbuf_loader_get_pixbuf (loader));
+
+  decoded = g_new0 (DecodedIcon, 1);
+  if (gdk_pixbuf_get_width (pixbuf) < DEFAULT_ICON_SIZE &&
+      gdk_pixbuf_get_height (pixbuf) < DEFAULT_ICON_SIZE)
+    {
+      double scale;
+
+      scale = MIN ((double) DEFAULT_ICON_SIZE / gdk_pixbuf_get_width (pixbuf),
+                   (double) DEFAULT_ICON_SIZE / gdk_pixbuf_get_height (pixbuf));
+      decoded->pixbuf = gdk_pixbuf_scale_simple (pixbuf,
+                                                 MAX (1, (int) (gdk_pixbuf_get_width (pixbuf) * scale + 0.5)),
+                                                 MAX (1, (int) (gdk_pixbuf_get_height (pixbuf) * scale + 0.5)),
+                                                 GDK_INTERP_BILINEAR);
+    }
+  else
+    decoded->pixbuf = g_object_ref (pixbuf);
+
+  /* Small PNGs are stored as they are, anything else is replaced by a
+   * PNG no larger than DEFAULT_ICON_SIZE. That includes vector images,
+   * which would otherwise carry their metadata along and could be
+   * arbitrarily expensive to render for whoever displays them later.
+   * Saving a pixbuf doesn't carry over any of the original metadata.
+   */
+  format = gdk_pixbuf_loader_get_format (loader);
+  if (format != NULL)
+    format_name = gdk_pixbuf_format_get_name (format);
+  keep_original = size <= MAX_KEPT_ICON_BYTES &&
+                  g_strcmp0 (format_name, "png") == 0 &&
+                  header.width <= DEFAULT_ICON_SIZE &&
+                  header.height <= DEFAULT_ICON_SIZE;
+
+  if (!keep_original)
+    {
+      g_autoptr(GBytes) png = NULL;
+      g_autoptr(GIcon) icon = NULL;
+      g_autoptr(GVariant) serialized = NULL;
+      char *buffer;
+      gsize length;
+
+      if (!gdk_pixbuf_save_to_buffer (pixbuf, &buffer, &length, "png", &error, NULL))
+        {
+          decoded_icon_free (decoded);
+          g_task_return_error (task, error);
+          return;
+        }
+
+      png = g_bytes_new_take (buffer, length);
+      icon = g_bytes_icon_new (png);
+      serialized = g_icon_serialize (icon);
+      decoded->icon_v = g_variant_ref_sink (g_variant_new_variant (serialized));
+
+      g_debug ("Re-encoded %dx%d %s icon (%" G_GSIZE_FORMAT " bytes) as %dx%d png (%" G_GSIZE_FORMAT " bytes)",
+               header.width, header.height, format_name, size,
+               gdk_pixbuf_get_width (pixbuf),
+               gdk_pixbuf_get_height (pixbuf),
+               length);
+    }
+
+  g_task_return_pointer (task, decoded, decoded_icon_free);
+}
+
+static void
+icon_decoded (GObject      *source,
+              GAsyncResult *result,
+              gpointer      data)
+{
+  InstallDialogHandle *handle = data;
+  DecodedIcon *decoded;
+  g_autoptr(GError) error = NULL;
+
+  decoded = g_task_propagate_pointer (G_TASK (result), &error);
+  if (decoded == NULL)
+    {
+      if (g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+        return;
+
+      g_warning ("Loading icon into pixbuf failed: %s", error->message);
+      handle->response = 2;
+      send_prepare_install_response (handle);
+      return;
+    }
+
+  gtk_image_set_from_pixbuf (GTK_IMAGE (handle->image), decoded->pixbuf);
+  gtk_dialog_set_response_sensitive (GTK_DIALOG (handle->dialog), GTK_RESPONSE_OK, TRUE);
+
+  if (decoded->icon_v)
+    {
+      g_variant_unref (handle->icon_v);
+      handle->icon_v = g_variant_ref (decoded->icon_v);
+    }
+
+  decoded_icon_free (decoded);
+}
+
+/* The icon comes straight from the app, so it is decoded in a thread
+ * while the dialog is already up, and can't be accepted until then.
+ */
+static void
+decode_icon (InstallDialogHandle *handle,
+             GBytes              *bytes)
+{
+  g_autoptr(GTask) task = NULL;
+
+  task = g_task_new (NULL, handle->cancellable, icon_decoded, handle);
+  g_task_set_source_tag (task, decode_icon);
+  g_task_set_task_data (task, g_bytes_ref (bytes), (GDestroyNotify) g_bytes_unref);
+  g_task_run_in_thread (task, decode_icon_thread);
+}
+
 static gboolean
 handle_prepare_install (XdpImplDynamicLauncher *object,
                         GDBusMethodInvocation  *invocation,
@@ -190,10 +436,8 @@ handle_prepare_install (XdpImplDynamicLauncher *object,
   gboolean modal, editable_name, editable_icon;
   DynamicLauncherType launcher_type;
   g_autoptr(GVariant) icon_v = NULL;
-  g_autoptr(GInputStream) icon_stream = NULL;
   g_autoptr(GIcon) icon = NULL;
-  g_autoptr(GdkPixbuf) pixbuf = NULL;
-  g_autoptr(GError) error = NULL;
+  GBytes *icon_bytes;
 
   sender = g_dbus_method_invocation_get_sender (invocation);
 
@@ -224,6 +468,7 @@ handle_prepare_install (XdpImplDynamicLauncher *object,
   handle->invocation = invocation;
   handle->request = g_object_ref (request);
   handle->external_parent = external_parent;
+  handle->cancellable = g_cancellable_new ();
 
   /* FIXME: Implement editable-icon option rather than passing along the default */
   handle->icon_v = g_variant_ref (arg_icon_v);
@@ -237,6 +482,13 @@ handle_prepare_install (XdpImplDynamicLauncher *object,
       goto err;
     }
 
+  icon_bytes = g_bytes_icon_get_bytes (G_BYTES_ICON (icon));
+  if (g_bytes_get_size (icon_bytes) > MAX_ICON_BYTES)
+    {
+      g_warning ("Icon is larger than %d bytes", MAX_ICON_BYTES);
+      goto err;
+    }
+
   if (!g_variant_lookup (arg_options, "launcher_type", "u", &launcher_type))
     launcher_type = DYNAMIC_LAUNCHER_TYPE_APPLICATION;
   if (launcher_type == DYNAMIC_LAUNCHER_TYPE_WEBAPP &&
@@ -278,24 +530,13 @@ handle_prepare_install (XdpImplDynamicLauncher *object,
   gtk_widget_set_margin_end (box, 15);
   gtk_container_add (GTK_CONTAINER (content_area), box);
 
-  image = gtk_image_new ();
+  image = gtk_image_new_from_icon_name ("application-x-executable", GTK_ICON_SIZE_DIALOG);
+  gtk_image_set_pixel_size (GTK_IMAGE (image), DEFAULT_ICON_SIZE);
   gtk_widget_set_vexpand (image, TRUE);
   gtk_widget_set_size_request (image, DEFAULT_ICON_SIZE, DEFAULT_ICON_SIZE);
   gtk_widget_set_margin_bottom (image, 10);
   gtk_container_add (GTK_CONTAINER (box), image);
 
-  icon_stream = g_loadable_icon_load (G_LOADABLE_ICON (icon), 0, NULL, NULL, &error);
-  if (icon_stream)
-    pixbuf = gdk_pixbuf_new_from_stream_at_scale (icon_stream,
-                                                  DEFAULT_ICON_SIZE, DEFAULT_ICON_SIZE,
-                                                  TRUE, NULL, &error);
-  if (error)
-    {
-      g_warning ("Loading icon into pixbuf failed: %s", error->message);
-      goto err;
-    }
-  gtk_image_set_from_pixbuf (GTK_IMAGE (image), pixbuf);
-
   entry = gtk_entry_new ();
   gtk_entry_set_text (GTK_ENTRY (entry), arg_name);
   gtk_widget_set_sensitive (entry, editable_name);
@@ -322,9 +563,11 @@ handle_prepare_install (XdpImplDynamicLauncher *object,
     }
 
   gtk_dialog_set_default_response (GTK_DIALOG (dialog), GTK_RESPONSE_OK);
+  gtk_dialog_set_response_sensitive (GTK_DIALOG (dialog), GTK_RESPONSE_OK, FALSE);
 
   handle->dialog = g_object_ref (dialog);
   handle->entry = entry;
+  handle->image = image;
 
   g_signal_connect (request, "handle-close", G_CALLBACK (handle_close), handle);
 
@@ -339,6 +582,8 @@ handle_prepare_install (XdpImplDynamicLauncher *object,
 
   gtk_widget_show_all (dialog);
 
+  decode_icon (handle, icon_bytes);
+
   return TRUE;
 
 err:
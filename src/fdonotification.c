@@ -27,11 +27,27 @@
  * This code is adapted from the GFdoNotificationBackend in GIO.
  */
 
-static guint fdo_notify_subscription;
-static GSList *fdo_notifications;
+/* The notification server is not required to tell us about notifications
+ * it drops or expires, and apps are not required to remove the ones they
+ * add. To keep the portal from growing without bound, the tracked entries
+ * are kept in LRU order and capped globally; optionally they are also
+ * capped per app and expire after a maximum age.
+ *
+ * Note that an evicted or expired notification is also closed on the
+ * server, even if it is still on screen: once it is no longer tracked,
+ * activating it could not be routed back to the app anyway. That is why
+ * there is no per-app cap by default, an app with many notifications on
+ * screen would otherwise see its older ones disappear.
+ */
+#define DEFAULT_MAX_NOTIFICATIONS_PER_APP 0
+#define DEFAULT_MAX_NOTIFICATIONS 1024
+
+typedef struct _FdoApp FdoApp;
 
 typedef struct
 {
+  int ref_count;
+  FdoApp *app;
   char *app_id;
   char *id;
   guint32 notify_id;
@@ -40,12 +56,72 @@ typedef struct
   ActivateAction activate_action;
   char *activation_token;
   gpointer data;
+  gboolean transient;
+  gint64 last_used;
+  GList lru_link;
+  GList app_link;
 } FdoNotification;
 
+struct _FdoApp
+{
+  char *app_id;
+  GHashTable *notifications;
+  GQueue lru;
+  guint name_watch;
+  char *name_owner;
+};
+
+/* What the running server can make use of. Until it has told us, assume
+ * everything except body markup, so that plain text is sent unescaped.
+ */
+typedef enum
+{
+  SERVER_CAPS_ACTIONS     = 1 << 0,
+  SERVER_CAPS_BODY        = 1 << 1,
+  SERVER_CAPS_BODY_MARKUP = 1 << 2,
+  SERVER_CAPS_ICONS       = 1 << 3,
+} ServerCaps;
+
+#define SERVER_CAPS_DEFAULT (SERVER_CAPS_ACTIONS | SERVER_CAPS_BODY | SERVER_CAPS_ICONS)
+
+static guint fdo_notify_subscription;
+static guint fdo_owner_subscription;
+static GDBusConnection *fdo_connection;
+
+static ServerCaps server_caps = SERVER_CAPS_DEFAULT;
+static guint server_caps_serial;
+
+/* All tracked notifications, most recently used first */
+static GQueue fdo_notifications = G_QUEUE_INIT;
+static GHashTable *fdo_apps;
+static GHashTable *fdo_notifications_by_notify_id;
+
+static guint max_notifications_per_app = DEFAULT_MAX_NOTIFICATIONS_PER_APP;
+static guint max_notifications = DEFAULT_MAX_NOTIFICATIONS;
+static guint max_notification_age;
+static guint expire_source;
+
+static guint64 n_evicted_app_limit;
+static guint64 n_evicted_global_limit;
+static guint64 n_expired;
+
+static gboolean close_transient_on_exit;
+
+static void call_close (GDBusConnection *connection,
+                        guint32 id);
+
+static FdoNotification *
+fdo_notification_ref (FdoNotification *n)
+{
+  n->ref_count++;
+  return n;
+}
+
 static void
-fdo_notification_free (gpointer data)
+fdo_notification_unref (FdoNotification *n)
 {
-  FdoNotification *n = data;
+  if (--n->ref_count > 0)
+    return;
 
   g_free (n->app_id);
   g_free (n->id);
@@ -57,36 +133,295 @@ fdo_notification_free (gpointer data)
   g_slice_free (FdoNotification, n);
 }
 
+static void
+fdo_app_free (gpointer data)
+{
+  FdoApp *app = data;
+
+  if (app->name_watch != 0)
+    g_bus_unwatch_name (app->name_watch);
+
+  g_hash_table_unref (app->notifications);
+  g_free (app->name_owner);
+  g_free (app->app_id);
+
+  g_slice_free (FdoApp, app);
+}
+
+static void
+ensure_tables (void)
+{
+  if (fdo_apps != NULL)
+    return;
+
+  fdo_apps = g_hash_table_new_full (g_str_hash, g_str_equal, NULL, fdo_app_free);
+  fdo_notifications_by_notify_id = g_hash_table_new (NULL, NULL);
+}
+
 static FdoNotification *
 fdo_find_notification (const char *app_id,
                        const char *id)
 {
-  GSList *l;
+  FdoApp *app;
 
-  for (l = fdo_notifications; l != NULL; l = l->next)
-    {
-      FdoNotification *n = l->data;
-      if (g_str_equal (n->app_id, app_id) &&
-          g_str_equal (n->id, id))
-        return n;
-    }
+  ensure_tables ();
+
+  app = g_hash_table_lookup (fdo_apps, app_id);
+  if (app == NULL)
+    return NULL;
 
-  return NULL;
+  return g_hash_table_lookup (app->notifications, id);
 }
 
 static FdoNotification *
 fdo_find_notification_by_notify_id (guint32 id)
 {
-  GSList *l;
+  if (id == 0)
+    return NULL;
+
+  ensure_tables ();
+
+  return g_hash_table_lookup (fdo_notifications_by_notify_id, GUINT_TO_POINTER (id));
+}
+
+static void
+fdo_set_notify_id (FdoNotification *n,
+                   guint32 notify_id)
+{
+  if (n->notify_id != 0 &&
+      g_hash_table_lookup (fdo_notifications_by_notify_id, GUINT_TO_POINTER (n->notify_id)) == n)
+    g_hash_table_remove (fdo_notifications_by_notify_id, GUINT_TO_POINTER (n->notify_id));
+
+  n->notify_id = notify_id;
+
+  if (n->notify_id != 0)
+    g_hash_table_insert (fdo_notifications_by_notify_id, GUINT_TO_POINTER (n->notify_id), n);
+}
+
+static void
+fdo_touch_notification (FdoNotification *n)
+{
+  n->last_used = g_get_monotonic_time ();
+
+  g_queue_unlink (&fdo_notifications, &n->lru_link);
+  g_queue_push_head_link (&fdo_notifications, &n->lru_link);
+
+  g_queue_unlink (&n->app->lru, &n->app_link);
+  g_queue_push_head_link (&n->app->lru, &n->app_link);
+}
+
+static gboolean expire_notifications (gpointer data);
+
+static void
+ensure_expire_source (void)
+{
+  if (max_notification_age == 0 || expire_source != 0)
+    return;
+
+  expire_source = g_timeout_add_seconds (CLAMP (max_notification_age / 2, 1, 60),
+                                         expire_notifications, NULL);
+}
+
+static void fdo_untrack_notification (FdoNotification *n);
+
+static void
+app_name_appeared (GDBusConnection *connection,
+                   const char *name,
+                   const char *name_owner,
+                   gpointer user_data)
+{
+  FdoApp *app;
+
+  app = g_hash_table_lookup (fdo_apps, name);
+  if (app == NULL)
+    return;
+
+  g_free (app->name_owner);
+  app->name_owner = g_strdup (name_owner);
+}
+
+static void
+app_name_vanished (GDBusConnection *connection,
+                   const char *name,
+                   gpointer user_data)
+{
+  FdoApp *app;
+  GList *l, *next;
+  guint n_closed = 0;
+
+  app = g_hash_table_lookup (fdo_apps, name);
+
+  /* Apps that are not running under their app id never appear on the bus */
+  if (app == NULL || app->name_owner == NULL)
+    return;
+
+  g_debug ("%s (%s) exited, closing its transient notifications",
+           app->app_id, app->name_owner);
+
+  g_clear_pointer (&app->name_owner, g_free);
 
-  for (l = fdo_notifications; l != NULL; l = l->next)
+  /* The CloseNotification calls are not waited for, so they go out
+   * back to back. The app is freed along with its last notification,
+   * which is also the last link in its list.
+   */
+  for (l = app->lru.head; l != NULL; l = next)
     {
       FdoNotification *n = l->data;
-      if (n->notify_id == id)
-        return n;
+
+      next = l->next;
+
+      if (!n->transient)
+        continue;
+
+      if (n->notify_id != 0)
+        call_close (connection, n->notify_id);
+
+      fdo_untrack_notification (n);
+      n_closed++;
+    }
+
+  if (n_closed > 0)
+    g_dbus_connection_flush (connection, NULL, NULL, NULL);
+}
+
+static void
+watch_app_name (FdoApp *app)
+{
+  if (!close_transient_on_exit || fdo_connection == NULL || app->name_watch != 0)
+    return;
+
+  if (!g_dbus_is_name (app->app_id) || g_dbus_is_unique_name (app->app_id))
+    return;
+
+  app->name_watch = g_bus_watch_name_on_connection (fdo_connection,
+                                                    app->app_id,
+                                                    G_BUS_NAME_WATCHER_FLAGS_NONE,
+                                                    app_name_appeared,
+                                                    app_name_vanished,
+                                                    NULL, NULL);
+}
+
+static void
+fdo_track_notification (FdoNotification *n)
+{
+  FdoApp *app;
+
+  ensure_tables ();
+
+  app = g_hash_table_lookup (fdo_apps, n->app_id);
+  if (app == NULL)
+    {
+      app = g_slice_new0 (FdoApp);
+      app->app_id = g_strdup (n->app_id);
+      app->notifications = g_hash_table_new (g_str_hash, g_str_equal);
+      g_queue_init (&app->lru);
+      g_hash_table_insert (fdo_apps, app->app_id, app);
     }
 
-  return NULL;
+  if (n->transient)
+    watch_app_name (app);
+
+  n->app = app;
+  n->last_used = g_get_monotonic_time ();
+  n->lru_link.data = n;
+  n->app_link.data = n;
+
+  g_hash_table_insert (app->notifications, n->id, n);
+  g_queue_push_head_link (&app->lru, &n->app_link);
+  g_queue_push_head_link (&fdo_notifications, &n->lru_link);
+
+  ensure_expire_source ();
+}
+
+/* Drops the tracking reference; @n must not be used afterwards unless the
+ * caller holds its own reference.
+ */
+static void
+fdo_untrack_notification (FdoNotification *n)
+{
+  FdoApp *app = n->app;
+
+  g_return_if_fail (app != NULL);
+
+  if (n->notify_id != 0 &&
+      g_hash_table_lookup (fdo_notifications_by_notify_id, GUINT_TO_POINTER (n->notify_id)) == n)
+    g_hash_table_remove (fdo_notifications_by_notify_id, GUINT_TO_POINTER (n->notify_id));
+
+  g_queue_unlink (&fdo_notifications, &n->lru_link);
+  g_queue_unlink (&app->lru, &n->app_link);
+  g_hash_table_remove (app->notifications, n->id);
+  n->app = NULL;
+
+  if (g_hash_table_size (app->notifications) == 0)
+    g_hash_table_remove (fdo_apps, app->app_id);
+
+  fdo_notification_unref (n);
+}
+
+static void
+fdo_evict_notification (FdoNotification *n)
+{
+  g_debug ("Evicting notification %s from %s", n->id, n->app_id);
+
+  if (n->notify_id != 0 && fdo_connection != NULL)
+    call_close (fdo_connection, n->notify_id);
+
+  fdo_untrack_notification (n);
+}
+
+static void
+enforce_limits (FdoApp *app)
+{
+  if (max_notifications_per_app > 0)
+    {
+      while (app->lru.length > max_notifications_per_app)
+        {
+          fdo_evict_notification (g_queue_peek_tail (&app->lru));
+          n_evicted_app_limit++;
+        }
+    }
+
+  if (max_notifications > 0)
+    {
+      while (fdo_notifications.length > max_notifications)
+        {
+          fdo_evict_notification (g_queue_peek_tail (&fdo_notifications));
+          n_evicted_global_limit++;
+        }
+    }
+}
+
+static gboolean
+expire_notifications (gpointer data)
+{
+  gint64 cutoff;
+
+  if (max_notification_age == 0)
+    {
+      expire_source = 0;
+      return G_SOURCE_REMOVE;
+    }
+
+  cutoff = g_get_monotonic_time () - (gint64) max_notification_age * G_USEC_PER_SEC;
+
+  while (fdo_notifications.length > 0)
+    {
+      FdoNotification *n = g_queue_peek_tail (&fdo_notifications);
+
+      if (n->last_used > cutoff)
+        break;
+
+      fdo_evict_notification (n);
+      n_expired++;
+    }
+
+  if (fdo_notifications.length == 0)
+    {
+      expire_source = 0;
+      return G_SOURCE_REMOVE;
+    }
+
+  return G_SOURCE_CONTINUE;
 }
 
 static void
@@ -167,8 +502,85 @@ notify_signal (GDBusConnection *connection,
         }
     }
 
-  fdo_notifications = g_slist_remove (fdo_notifications, n);
-  fdo_notification_free (n);
+  fdo_untrack_notification (n);
+}
+
+static void
+got_server_capabilities (GObject      *source_object,
+                         GAsyncResult *result,
+                         gpointer      user_data)
+{
+  g_autoptr(GVariant) ret = NULL;
+  g_autoptr(GError) error = NULL;
+  g_autofree const char **caps = NULL;
+  ServerCaps new_caps = 0;
+  guint i;
+
+  ret = g_dbus_connection_call_finish (G_DBUS_CONNECTION (source_object), result, &error);
+
+  /* The server was replaced while we were asking */
+  if (GPOINTER_TO_UINT (user_data) != server_caps_serial)
+    return;
+
+  if (ret == NULL)
+    {
+      g_debug ("Could not get notification server capabilities: %s", error->message);
+      return;
+    }
+
+  g_variant_get (ret, "(^a&s)", &caps);
+  for (i = 0; caps[i]; i++)
+    {
+      if (g_str_equal (caps[i], "actions"))
+        new_caps |= SERVER_CAPS_ACTIONS;
+      else if (g_str_equal (caps[i], "body"))
+        new_caps |= SERVER_CAPS_BODY;
+      else if (g_str_equal (caps[i], "body-markup"))
+        new_caps |= SERVER_CAPS_BODY_MARKUP;
+      else if (g_str_equal (caps[i], "icon-static") ||
+               g_str_equal (caps[i], "icon-multi"))
+        new_caps |= SERVER_CAPS_ICONS;
+    }
+
+  g_debug ("Notification server capabilities: 0x%x", new_caps);
+
+  server_caps = new_caps;
+}
+
+static void
+query_server_capabilities (GDBusConnection *connection)
+{
+  g_dbus_connection_call (connection,
+                          "org.freedesktop.Notifications",
+                          "/org/freedesktop/Notifications",
+                          "org.freedesktop.Notifications",
+                          "GetCapabilities",
+                          NULL,
+                          G_VARIANT_TYPE ("(as)"),
+                          G_DBUS_CALL_FLAGS_NONE,
+                          -1, NULL,
+                          got_server_capabilities,
+                          GUINT_TO_POINTER (server_caps_serial));
+}
+
+static void
+server_owner_changed (GDBusConnection *connection,
+                      const char *sender_name,
+                      const char *object_path,
+                      const char *interface_name,
+                      const char *signal_name,
+                      GVariant *parameters,
+                      gpointer user_data)
+{
+  const char *new_owner;
+
+  g_variant_get (parameters, "(&s&s&s)", NULL, NULL, &new_owner);
+
+  server_caps_serial++;
+  server_caps = SERVER_CAPS_DEFAULT;
+
+  if (new_owner[0] != '\0')
+    query_server_capabilities (connection);
 }
 
 static guchar
@@ -193,12 +605,19 @@ notification_sent (GObject      *source_object,
   GVariant *val;
   GError *error = NULL;
   static gboolean warning_printed = FALSE;
+  guint32 notify_id;
 
   val = g_dbus_connection_call_finish (G_DBUS_CONNECTION (source_object), result, &error);
   if (val)
     {
-      g_variant_get (val, "(u)", &n->notify_id);
+      g_variant_get (val, "(u)", &notify_id);
       g_variant_unref (val);
+
+      /* Removed or evicted while the call was in flight */
+      if (n->app == NULL)
+        call_close (G_DBUS_CONNECTION (source_object), notify_id);
+      else
+        fdo_set_notify_id (n, notify_id);
     }
   else
     {
@@ -209,46 +628,27 @@ notification_sent (GObject      *source_object,
           warning_printed = TRUE;
         }
 
-      fdo_notifications = g_slist_remove (fdo_notifications, n);
-      fdo_notification_free (n);
+      if (n->app != NULL)
+        fdo_untrack_notification (n);
 
       g_error_free (error);
     }
+
+  fdo_notification_unref (n);
 }
 
 static void
-call_notify (GDBusConnection *connection,
-             FdoNotification *fdo,
+add_actions (GVariantBuilder *action_builder,
              GVariant *notification)
 {
-  GVariantBuilder action_builder;
   guint i;
-  GVariantBuilder hints_builder;
-  GVariant *icon;
-  const char *body;
-  const char *title;
-  g_autofree char *icon_name = NULL;
-  guchar urgency;
   const char *dummy;
   g_autoptr(GVariant) buttons = NULL;
-  const char *priority;
 
-  if (fdo_notify_subscription == 0)
-    {
-      fdo_notify_subscription =
-        g_dbus_connection_signal_subscribe (connection,
-                                            "org.freedesktop.Notifications",
-                                            "org.freedesktop.Notifications", NULL,
-                                            "/org/freedesktop/Notifications", NULL,
-                                            G_DBUS_SIGNAL_FLAGS_NONE,
-                                            notify_signal, NULL, NULL);
-    }
-
-  g_variant_builder_init (&action_builder, G_VARIANT_TYPE_STRING_ARRAY);
   if (g_variant_lookup (notification, "default-action", "&s", &dummy))
     {
-      g_variant_builder_add (&action_builder, "s", "default");
-      g_variant_builder_add (&action_builder, "s", "");
+      g_variant_builder_add (action_builder, "s", "default");
+      g_variant_builder_add (action_builder, "s", "");
     }
 
   buttons = g_variant_lookup_value (notification, "buttons", G_VARIANT_TYPE("aa{sv}"));
@@ -278,9 +678,83 @@ call_notify (GDBusConnection *connection,
             detailed_name = g_dbus_generate_guid ();
           }
 
-        g_variant_builder_add_value (&action_builder, g_variant_new_string (detailed_name));
-        g_variant_builder_add_value (&action_builder, g_variant_new_string (label));
+        g_variant_builder_add_value (action_builder, g_variant_new_string (detailed_name));
+        g_variant_builder_add_value (action_builder, g_variant_new_string (label));
       }
+}
+
+static char *
+get_body (GVariant *notification)
+{
+  const char *body;
+  const char *markup_body;
+  char *text;
+
+  if ((server_caps & SERVER_CAPS_BODY) == 0)
+    return g_strdup ("");
+
+  if (!g_variant_lookup (notification, "markup-body", "&s", &markup_body))
+    markup_body = NULL;
+
+  if (markup_body && (server_caps & SERVER_CAPS_BODY_MARKUP))
+    return g_strdup (markup_body);
+
+  if (g_variant_lookup (notification, "body", "&s", &body))
+    {
+      if (server_caps & SERVER_CAPS_BODY_MARKUP)
+        return g_markup_escape_text (body, -1);
+      else
+        return g_strdup (body);
+    }
+
+  if (markup_body && pango_parse_markup (markup_body, -1, 0, NULL, &text, NULL, NULL))
+    return text;
+
+  return g_strdup ("");
+}
+
+static void
+call_notify (GDBusConnection *connection,
+             FdoNotification *fdo,
+             GVariant *notification)
+{
+  GVariantBuilder action_builder;
+  GVariantBuilder hints_builder;
+  g_autoptr(GVariant) icon = NULL;
+  g_autofree char *body = NULL;
+  const char *title;
+  g_autofree char *icon_name = NULL;
+  guchar urgency;
+  const char *priority;
+
+  if (fdo_notify_subscription == 0)
+    {
+      fdo_notify_subscription =
+        g_dbus_connection_signal_subscribe (connection,
+                                            "org.freedesktop.Notifications",
+                                            "org.freedesktop.Notifications", NULL,
+                                            "/org/freedesktop/Notifications", NULL,
+                                            G_DBUS_SIGNAL_FLAGS_NONE,
+                                            notify_signal, NULL, NULL);
+    }
+
+  if (fdo_owner_subscription == 0)
+    {
+      fdo_owner_subscription =
+        g_dbus_connection_signal_subscribe (connection,
+                                            "org.freedesktop.DBus",
+                                            "org.freedesktop.DBus",
+                                            "NameOwnerChanged",
+                                            "/org/freedesktop/DBus",
+                                            "org.freedesktop.Notifications",
+                                            G_DBUS_SIGNAL_FLAGS_NONE,
+                                            server_owner_changed, NULL, NULL);
+      query_server_capabilities (connection);
+    }
+
+  g_variant_builder_init (&action_builder, G_VARIANT_TYPE_STRING_ARRAY);
+  if (server_caps & SERVER_CAPS_ACTIONS)
+    add_actions (&action_builder, notification);
 
   g_variant_builder_init (&hints_builder, G_VARIANT_TYPE ("a{sv}"));
   g_variant_builder_add (&hints_builder, "{sv}", "desktop-entry", g_variant_new_string (fdo->app_id));
@@ -306,8 +780,9 @@ call_notify (GDBusConnection *connection,
            const gchar* const* icon_names = g_themed_icon_get_names (G_THEMED_ICON (gicon));
            icon_name = g_strdup (icon_names[0]);
         }
-      else if (G_IS_BYTES_ICON (gicon))
+      else if (G_IS_BYTES_ICON (gicon) && (server_caps & SERVER_CAPS_ICONS))
         {
+           /* Don't bother decoding images the server won't show */
            g_autoptr(GInputStream) istream = NULL;
            g_autoptr(GdkPixbuf) pixbuf = NULL;
            int width, height, rowstride, n_channels, bits_per_sample;
@@ -353,8 +828,7 @@ call_notify (GDBusConnection *connection,
   if (icon_name == NULL)
     icon_name = g_strdup ("");
 
-  if (!g_variant_lookup (notification, "body", "&s", &body))
-    body = "";
+  body = get_body (notification);
   if (!g_variant_lookup (notification, "title", "&s", &title))
     title= "";
 
@@ -375,7 +849,7 @@ call_notify (GDBusConnection *connection,
                           G_VARIANT_TYPE ("(u)"),
                           G_DBUS_CALL_FLAGS_NONE,
                           -1, NULL,
-                          notification_sent, fdo);
+                          notification_sent, fdo_notification_ref (fdo));
 }
 
 static void
@@ -406,8 +880,7 @@ fdo_remove_notification (GDBusConnection *connection,
       if (n->notify_id > 0)
         call_close (connection, n->notify_id);
 
-      fdo_notifications = g_slist_remove (fdo_notifications, n);
-      fdo_notification_free (n);
+      fdo_untrack_notification (n);
 
       return TRUE;
     }
@@ -424,30 +897,86 @@ fdo_add_notification (GDBusConnection *connection,
                       gpointer data)
 {
   FdoNotification *n;
+  g_autofree const char **display_hints = NULL;
+  gboolean transient = FALSE;
+
+  if (fdo_connection == NULL)
+    fdo_connection = g_object_ref (connection);
+
+  if (g_variant_lookup (notification, "display-hint", "^a&s", &display_hints))
+    transient = g_strv_contains (display_hints, "transient");
 
   n = fdo_find_notification (app_id, id);
   if (n == NULL)
     {
       n = g_slice_new0 (FdoNotification);
+      n->ref_count = 1;
       n->app_id = g_strdup (app_id);
       n->id = g_strdup (id);
       n->notify_id = 0;
       n->activate_action = activate_action;
       n->activation_token = NULL;
       n->data = data;
+      n->transient = transient;
 
-      fdo_notifications = g_slist_prepend (fdo_notifications, n);
+      fdo_track_notification (n);
     }
   else
     {
       /* Only clear default action. All other fields are still valid */
       g_clear_pointer (&n->default_action, g_free);
       g_clear_pointer (&n->default_action_target, g_variant_unref);
+
+      n->transient = transient;
+      if (n->transient)
+        watch_app_name (n->app);
+
+      fdo_touch_notification (n);
     }
 
   g_variant_lookup (notification, "default-action", "s", &n->default_action);
   n->default_action_target = g_variant_lookup_value (notification, "default-action-target", NULL);
 
   call_notify (connection, n, notification);
+
+  enforce_limits (n->app);
+}
+
+/* 0 means no limit, a negative value keeps the current one */
+void
+fdo_set_notification_limits (int max_per_app,
+                             int max_total,
+                             int max_age)
+{
+  if (max_per_app >= 0)
+    max_notifications_per_app = max_per_app;
+  if (max_total >= 0)
+    max_notifications = max_total;
+  if (max_age >= 0)
+    max_notification_age = max_age;
+
+  if (expire_source != 0)
+    {
+      g_source_remove (expire_source);
+      expire_source = 0;
+    }
+  if (fdo_notifications.length > 0)
+    ensure_expire_source ();
+}
+
+void
+fdo_set_close_transient_on_exit (gboolean close_transient)
+{
+  close_transient_on_exit = close_transient;
+}
+
+void
+fdo_get_notification_stats (FdoNotificationStats *stats)
+{
+  stats->n_notifications = fdo_notifications.length;
+  stats->n_apps = fdo_apps ? g_hash_table_size (fdo_apps) : 0;
+  stats->n_evicted_app_limit = n_evicted_app_limit;
+  stats->n_evicted_global_limit = n_evicted_global_limit;
+  stats->n_expired = n_expired;
 }
 
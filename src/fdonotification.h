@@ -40,3 +40,18 @@ gboolean fdo_remove_notification (GDBusConnection *connection,
                                   const char *app_id,
                                   const char *id);
 
+
+typedef struct
+{
+  guint n_notifications;
+  guint n_apps;
+  guint64 n_evicted_app_limit;
+  guint64 n_evicted_global_limit;
+  guint64 n_expired;
+} FdoNotificationStats;
+
+void fdo_set_notification_limits (int max_per_app,
+                                  int max_total,
+                                  int max_age);
+void fdo_set_close_transient_on_exit (gboolean close_transient);
+void fdo_get_notification_stats (FdoNotificationStats *stats);
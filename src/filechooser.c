@@ -43,6 +43,7 @@
 #include "request.h"
 #include "utils.h"
 #include "gtkbackports.h"
+#include "filefilter.h"
 #include "externalwindow.h"
 
 
@@ -55,16 +56,20 @@ typedef struct {
   gboolean multiple;
   ExternalWindow *external_parent;
 
-  GSList *files;
+  GPtrArray *files;
 
   GtkFileFilter *filter;
 
   int response;
-  GSList *uris;
+  GPtrArray *uris;
 
   gboolean allow_write;
 
   GHashTable *choices;
+
+  /* SaveFiles: names seen in the target folder */
+  GCancellable *cancellable;
+  GHashTable *taken_names;
 } FileDialogHandle;
 
 static void
@@ -72,12 +77,15 @@ file_dialog_handle_free (gpointer data)
 {
   FileDialogHandle *handle = data;
 
+  g_cancellable_cancel (handle->cancellable);
+  g_object_unref (handle->cancellable);
   g_clear_object (&handle->external_parent);
   g_object_unref (handle->dialog);
   g_object_unref (handle->request);
-  g_slist_free_full (handle->files, g_free);
-  g_slist_free_full (handle->uris, g_free);
+  g_ptr_array_unref (handle->files);
+  g_ptr_array_unref (handle->uris);
   g_hash_table_unref (handle->choices);
+  g_clear_pointer (&handle->taken_names, g_hash_table_unref);
 
   g_free (handle);
 }
@@ -85,6 +93,7 @@ file_dialog_handle_free (gpointer data)
 static void
 file_dialog_handle_close (FileDialogHandle *handle)
 {
+  g_object_set_data (G_OBJECT (handle->dialog), "preview-cancellable", NULL);
   gtk_widget_destroy (handle->dialog);
   file_dialog_handle_free (handle);
 }
@@ -106,12 +115,33 @@ add_choices (FileDialogHandle *handle,
   g_variant_builder_add (builder, "{sv}", "choices", g_variant_builder_end (&choices));
 }
 
+/* Apps whose files are kept out of the recently used list */
+static char **no_recent_apps;
+
+/* All files of a response are added to the in-memory list before
+ * GtkRecentManager saves it, which it does once after a short delay,
+ * so this costs a single rewrite of recently-used.xbel. Writing the
+ * file ourselves would race with the recent manager and with other
+ * processes.
+ */
 static void
-add_recent_entry (const char *app_id,
-                  const char *uri)
+add_recent_entries (const char *app_id,
+                    GPtrArray *uris)
 {
   GtkRecentManager *recent;
   GtkRecentData data;
+  gboolean enabled = TRUE;
+  guint i;
+
+  if (uris->len == 0)
+    return;
+
+  if (no_recent_apps && g_strv_contains ((const char * const *) no_recent_apps, app_id))
+    return;
+
+  g_object_get (gtk_settings_get_default (), "gtk-recent-files-enabled", &enabled, NULL);
+  if (!enabled)
+    return;
 
   /* These fields are ignored by everybody, so it is not worth
    * spending effort on filling them out. Just use defaults.
@@ -125,7 +155,8 @@ add_recent_entry (const char *app_id,
   data.is_private = FALSE;
 
   recent = gtk_recent_manager_get_default ();
-  gtk_recent_manager_add_full (recent, uri, &data);
+  for (i = 0; i < uris->len; i++)
+    gtk_recent_manager_add_full (recent, g_ptr_array_index (uris, i), &data);
 }
 
 static void
@@ -133,56 +164,25 @@ send_response (FileDialogHandle *handle)
 {
   GVariantBuilder uri_builder;
   GVariantBuilder opt_builder;
-  GSList *l;
   const char *method_name;
+  guint i;
 
   method_name = g_dbus_method_invocation_get_method_name (handle->invocation);
 
   g_variant_builder_init (&opt_builder, G_VARIANT_TYPE_VARDICT);
 
-  if (strcmp (method_name, "SaveFiles") == 0 &&
-      handle->action == GTK_FILE_CHOOSER_ACTION_SELECT_FOLDER &&
-      handle->uris)
+  g_variant_builder_init (&uri_builder, G_VARIANT_TYPE_STRING_ARRAY);
+  for (i = 0; i < handle->uris->len; i++)
     {
-      g_autoptr(GFile) base_dir = g_file_new_for_uri (handle->uris->data);
+      const char *uri = g_ptr_array_index (handle->uris, i);
 
-      g_slist_free_full (handle->uris, g_free);
-      handle->uris = NULL;
-
-      for (l = handle->files; l; l = l->next)
-        {
-          int uniqifier = 0;
-          const char *file_name = l->data;
-          g_autoptr(GFile) file = g_file_get_child (base_dir, file_name);
-
-          while (g_file_query_exists(file, NULL))
-            {
-              g_autofree char *base_name = g_file_get_basename (file);
-              g_auto(GStrv) parts = NULL;
-              g_autoptr(GString) unique_name = NULL;
-
-              parts = g_strsplit (base_name, ".", 2);
-
-              unique_name = g_string_new (parts[0]);
-              g_string_append_printf (unique_name, "(%i)", ++uniqifier);
-              if (parts[1] != NULL)
-                  g_string_append (unique_name, parts[1]);
-
-              file = g_file_get_child (base_dir, unique_name->str);
-            }
-          handle->uris = g_slist_append (handle->uris, g_file_get_uri (file));
-        }
+      g_variant_builder_add (&uri_builder, "s", uri);
     }
 
-  g_variant_builder_init (&uri_builder, G_VARIANT_TYPE_STRING_ARRAY);
-  for (l = handle->uris; l; l = l->next)
-    {
-      add_recent_entry (handle->request->app_id, l->data);
-      g_variant_builder_add (&uri_builder, "s", l->data);
-    }
+  add_recent_entries (handle->request->app_id, handle->uris);
 
   if (handle->filter) {
-    GVariant *current_filter_variant = gtk_file_filter_to_gvariant (handle->filter);
+    g_autoptr(GVariant) current_filter_variant = file_filter_to_gvariant (handle->filter);
     g_variant_builder_add (&opt_builder, "{sv}", "current_filter", current_filter_variant);
   }
 
@@ -215,12 +215,234 @@ send_response (FileDialogHandle *handle)
   file_dialog_handle_close (handle);
 }
 
+/* For SaveFiles, "foo.tar.gz" becomes "foo(1).tar.gz" */
+static char *
+make_unique_name (const char *file_name,
+                  int uniquifier)
+{
+  const char *dot;
+
+  dot = strchr (file_name[0] == '.' ? file_name + 1 : file_name, '.');
+  if (dot)
+    return g_strdup_printf ("%.*s(%d)%s", (int) (dot - file_name), file_name, uniquifier, dot);
+  else
+    return g_strdup_printf ("%s(%d)", file_name, uniquifier);
+}
+
+typedef struct {
+  GFile *base_dir;
+  GPtrArray *files;
+  GHashTable *taken_names;
+} SaveFilesData;
+
+static void
+save_files_data_free (gpointer data)
+{
+  SaveFilesData *save = data;
+
+  g_object_unref (save->base_dir);
+  g_ptr_array_unref (save->files);
+  g_hash_table_unref (save->taken_names);
+  g_free (save);
+}
+
+/* The folder listing only tells us which names are certainly taken.
+ * It can be stale, and it can't know whether the filesystem ignores
+ * case, so a name it doesn't have is confirmed on disk before use.
+ */
+static gboolean
+name_taken (SaveFilesData *save,
+            const char *name)
+{
+  g_autoptr(GFile) file = NULL;
+
+  if (g_hash_table_contains (save->taken_names, name))
+    return TRUE;
+
+  file = g_file_get_child (save->base_dir, name);
+  return g_file_query_exists (file, NULL);
+}
+
+static void
+resolve_save_files_thread (GTask *task,
+                           gpointer source_object,
+                           gpointer task_data,
+                           GCancellable *cancellable)
+{
+  SaveFilesData *save = task_data;
+  g_autoptr(GHashTable) uniquifiers = NULL;
+  GPtrArray *uris;
+  guint i;
+
+  uniquifiers = g_hash_table_new (g_str_hash, g_str_equal);
+  uris = g_ptr_array_new_with_free_func (g_free);
+
+  for (i = 0; i < save->files->len; i++)
+    {
+      const char *file_name = g_ptr_array_index (save->files, i);
+      g_autofree char *unique_name = g_strdup (file_name);
+      g_autoptr(GFile) file = NULL;
+      int uniquifier;
+
+      if (g_task_return_error_if_cancelled (task))
+        {
+          g_ptr_array_unref (uris);
+          return;
+        }
+
+      uniquifier = GPOINTER_TO_INT (g_hash_table_lookup (uniquifiers, file_name));
+
+      while (name_taken (save, unique_name))
+        {
+          g_free (unique_name);
+          unique_name = make_unique_name (file_name, ++uniquifier);
+        }
+
+      g_hash_table_insert (uniquifiers, (gpointer) file_name, GINT_TO_POINTER (uniquifier));
+
+      file = g_file_get_child (save->base_dir, unique_name);
+      g_ptr_array_add (uris, g_file_get_uri (file));
+
+      /* Later files in the same request must not get this name either */
+      g_hash_table_add (save->taken_names, g_steal_pointer (&unique_name));
+    }
+
+  g_task_return_pointer (task, uris, (GDestroyNotify) g_ptr_array_unref);
+}
+
+static void
+save_files_resolved (GObject *source_object,
+                     GAsyncResult *result,
+                     gpointer data)
+{
+  FileDialogHandle *handle = data;
+  g_autoptr(GError) error = NULL;
+  GPtrArray *uris;
+
+  uris = g_task_propagate_pointer (G_TASK (result), &error);
+
+  /* The request was closed, and handle is gone */
+  if (g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+    return;
+
+  g_ptr_array_unref (handle->uris);
+  handle->uris = uris;
+
+  send_response (handle);
+}
+
+static void
+resolve_save_files (FileDialogHandle *handle)
+{
+  g_autoptr(GTask) task = NULL;
+  SaveFilesData *save;
+
+  save = g_new0 (SaveFilesData, 1);
+  save->base_dir = g_file_new_for_uri (g_ptr_array_index (handle->uris, 0));
+  save->files = g_ptr_array_ref (handle->files);
+  save->taken_names = g_steal_pointer (&handle->taken_names);
+
+  task = g_task_new (NULL, handle->cancellable, save_files_resolved, handle);
+  g_task_set_source_tag (task, resolve_save_files);
+  g_task_set_task_data (task, save, save_files_data_free);
+  g_task_run_in_thread (task, resolve_save_files_thread);
+}
+
+static void
+save_folder_listed (GObject *source_object,
+                    GAsyncResult *result,
+                    gpointer data)
+{
+  GFileEnumerator *enumerator = G_FILE_ENUMERATOR (source_object);
+  FileDialogHandle *handle = data;
+  g_autoptr(GError) error = NULL;
+  GList *infos, *l;
+
+  infos = g_file_enumerator_next_files_finish (enumerator, result, &error);
+
+  /* The request was closed, and handle is gone */
+  if (g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+    {
+      g_object_unref (enumerator);
+      return;
+    }
+
+  if (error)
+    {
+      g_warning ("Failed to list save folder: %s", error->message);
+      g_object_unref (enumerator);
+      resolve_save_files (handle);
+      return;
+    }
+
+  if (infos == NULL)
+    {
+      g_object_unref (enumerator);
+      resolve_save_files (handle);
+      return;
+    }
+
+  for (l = infos; l; l = l->next)
+    g_hash_table_add (handle->taken_names, g_strdup (g_file_info_get_name (l->data)));
+  g_list_free_full (infos, g_object_unref);
+
+  g_file_enumerator_next_files_async (enumerator, 1000, G_PRIORITY_DEFAULT,
+                                      handle->cancellable,
+                                      save_folder_listed, handle);
+}
+
+static void
+save_folder_opened (GObject *source_object,
+                    GAsyncResult *result,
+                    gpointer data)
+{
+  FileDialogHandle *handle = data;
+  g_autoptr(GError) error = NULL;
+  GFileEnumerator *enumerator;
+
+  enumerator = g_file_enumerate_children_finish (G_FILE (source_object), result, &error);
+
+  if (g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+    return;
+
+  if (enumerator == NULL)
+    {
+      g_warning ("Failed to list save folder: %s", error->message);
+      resolve_save_files (handle);
+      return;
+    }
+
+  g_file_enumerator_next_files_async (enumerator, 1000, G_PRIORITY_DEFAULT,
+                                      handle->cancellable,
+                                      save_folder_listed, handle);
+}
+
+/* Take a single snapshot of the folder, so that names known to be taken
+ * are skipped without a stat, then pick the names in a thread.
+ */
+static void
+list_save_folder (FileDialogHandle *handle)
+{
+  g_autoptr(GFile) base_dir = NULL;
+
+  handle->taken_names = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+
+  base_dir = g_file_new_for_uri (g_ptr_array_index (handle->uris, 0));
+  g_file_enumerate_children_async (base_dir,
+                                   G_FILE_ATTRIBUTE_STANDARD_NAME,
+                                   G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS,
+                                   G_PRIORITY_DEFAULT,
+                                   handle->cancellable,
+                                   save_folder_opened, handle);
+}
+
 static void
 file_chooser_response (GtkWidget *widget,
                        int response,
                        gpointer user_data)
 {
   FileDialogHandle *handle = user_data;
+  GSList *uris, *l;
 
   switch (response)
     {
@@ -228,23 +450,33 @@ file_chooser_response (GtkWidget *widget,
       g_warning ("Unexpected response: %d", response);
       handle->response = 2;
       handle->filter = NULL;
-      handle->uris = NULL;
       break;
 
     case GTK_RESPONSE_DELETE_EVENT:
     case GTK_RESPONSE_CANCEL:
       handle->response = 1;
       handle->filter = NULL;
-      handle->uris = NULL;
       break;
 
     case GTK_RESPONSE_OK:
       handle->response = 0;
       handle->filter = gtk_file_chooser_get_filter (GTK_FILE_CHOOSER(widget));
-      handle->uris = gtk_file_chooser_get_uris (GTK_FILE_CHOOSER (widget));
+      uris = gtk_file_chooser_get_uris (GTK_FILE_CHOOSER (widget));
+      for (l = uris; l; l = l->next)
+        g_ptr_array_add (handle->uris, l->data);
+      g_slist_free (uris);
       break;
     }
 
+  if (strcmp (g_dbus_method_invocation_get_method_name (handle->invocation), "SaveFiles") == 0 &&
+      handle->action == GTK_FILE_CHOOSER_ACTION_SELECT_FOLDER &&
+      handle->uris->len > 0)
+    {
+      gtk_widget_hide (handle->dialog);
+      list_save_folder (handle);
+      return;
+    }
+
   send_response (handle);
 }
 
@@ -374,27 +606,481 @@ handle_close (XdpImplRequest *object,
   return TRUE;
 }
 
+#define PREVIEW_SIZE 128
+#define PREVIEW_CACHE_SIZE 32
+
+/* Recently decoded previews, most recently used first. Shared between
+ * the preview loader threads, hence the lock.
+ */
+typedef struct {
+  char *uri;
+  guint64 mtime;
+  GdkPixbuf *pixbuf;
+} PreviewCacheEntry;
+
+static GMutex preview_cache_lock;
+static GQueue preview_cache = G_QUEUE_INIT;
+
+static void
+preview_cache_entry_free (PreviewCacheEntry *entry)
+{
+  g_free (entry->uri);
+  g_object_unref (entry->pixbuf);
+  g_free (entry);
+}
+
+static GdkPixbuf *
+preview_cache_lookup (const char *uri,
+                      guint64 mtime)
+{
+  GdkPixbuf *pixbuf = NULL;
+  GList *l;
+
+  g_mutex_lock (&preview_cache_lock);
+
+  for (l = preview_cache.head; l; l = l->next)
+    {
+      PreviewCacheEntry *entry = l->data;
+
+      if (g_str_equal (entry->uri, uri))
+        {
+          if (entry->mtime == mtime)
+            {
+              pixbuf = g_object_ref (entry->pixbuf);
+              g_queue_unlink (&preview_cache, l);
+              g_queue_push_head_link (&preview_cache, l);
+            }
+          break;
+        }
+    }
+
+  g_mutex_unlock (&preview_cache_lock);
+
+  return pixbuf;
+}
+
+static void
+preview_cache_insert (const char *uri,
+                      guint64 mtime,
+                      GdkPixbuf *pixbuf)
+{
+  PreviewCacheEntry *entry;
+  GList *l;
+
+  g_mutex_lock (&preview_cache_lock);
+
+  for (l = preview_cache.head; l; l = l->next)
+    {
+      entry = l->data;
+
+      if (g_str_equal (entry->uri, uri))
+        {
+          g_queue_delete_link (&preview_cache, l);
+          preview_cache_entry_free (entry);
+          break;
+        }
+    }
+
+  entry = g_new0 (PreviewCacheEntry, 1);
+  entry->uri = g_strdup (uri);
+  entry->mtime = mtime;
+  entry->pixbuf = g_object_ref (pixbuf);
+  g_queue_push_head (&preview_cache, entry);
+
+  while (preview_cache.length > PREVIEW_CACHE_SIZE)
+    preview_cache_entry_free (g_queue_pop_tail (&preview_cache));
+
+  g_mutex_unlock (&preview_cache_lock);
+}
+
+/* Look for an up-to-date thumbnail in the freedesktop.org thumbnail cache,
+ * see https://specifications.freedesktop.org/thumbnail-spec/
+ */
+static GdkPixbuf *
+load_thumbnail (const char *uri,
+                guint64 mtime)
+{
+  const char *sizes[] = { "normal", "large" };
+  g_autofree char *md5 = NULL;
+  g_autofree char *basename = NULL;
+  guint i;
+
+  md5 = g_compute_checksum_for_string (G_CHECKSUM_MD5, uri, -1);
+  basename = g_strconcat (md5, ".png", NULL);
+
+  for (i = 0; i < G_N_ELEMENTS (sizes); i++)
+    {
+      g_autofree char *path = NULL;
+      g_autoptr(GdkPixbuf) thumbnail = NULL;
+      const char *thumb_uri;
+      const char *thumb_mtime;
+      int width, height;
+
+      path = g_build_filename (g_get_user_cache_dir (), "thumbnails", sizes[i], basename, NULL);
+      thumbnail = gdk_pixbuf_new_from_file (path, NULL);
+      if (thumbnail == NULL)
+        continue;
+
+      thumb_uri = gdk_pixbuf_get_option (thumbnail, "tEXt::Thumb::URI");
+      thumb_mtime = gdk_pixbuf_get_option (thumbnail, "tEXt::Thumb::MTime");
+      if (g_strcmp0 (thumb_uri, uri) != 0 ||
+          thumb_mtime == NULL ||
+          g_ascii_strtoull (thumb_mtime, NULL, 10) != mtime)
+        continue;
+
+      width = gdk_pixbuf_get_width (thumbnail);
+      height = gdk_pixbuf_get_height (thumbnail);
+      if (width <= PREVIEW_SIZE && height <= PREVIEW_SIZE)
+        return g_steal_pointer (&thumbnail);
+
+      if (width > height)
+        return gdk_pixbuf_scale_simple (thumbnail,
+                                        PREVIEW_SIZE,
+                                        MAX (1, height * PREVIEW_SIZE / width),
+                                        GDK_INTERP_BILINEAR);
+      else
+        return gdk_pixbuf_scale_simple (thumbnail,
+                                        MAX (1, width * PREVIEW_SIZE / height),
+                                        PREVIEW_SIZE,
+                                        GDK_INTERP_BILINEAR);
+    }
+
+  return NULL;
+}
+
+static void
+load_preview_thread (GTask *task,
+                     gpointer source_object,
+                     gpointer task_data,
+                     GCancellable *cancellable)
+{
+  GFile *file = task_data;
+  g_autoptr(GFileInfo) info = NULL;
+  g_autoptr(GdkPixbuf) pixbuf = NULL;
+  g_autofree char *uri = NULL;
+  guint64 mtime;
+
+  info = g_file_query_info (file,
+                            G_FILE_ATTRIBUTE_STANDARD_TYPE ","
+                            G_FILE_ATTRIBUTE_TIME_MODIFIED,
+                            G_FILE_QUERY_INFO_NONE,
+                            cancellable,
+                            NULL);
+  if (info == NULL || g_file_info_get_file_type (info) != G_FILE_TYPE_REGULAR)
+    {
+      g_task_return_pointer (task, NULL, NULL);
+      return;
+    }
+
+  uri = g_file_get_uri (file);
+  mtime = g_file_info_get_attribute_uint64 (info, G_FILE_ATTRIBUTE_TIME_MODIFIED);
+
+  pixbuf = preview_cache_lookup (uri, mtime);
+
+  if (pixbuf == NULL && !g_cancellable_is_cancelled (cancellable))
+    pixbuf = load_thumbnail (uri, mtime);
+
+  if (pixbuf == NULL && !g_cancellable_is_cancelled (cancellable))
+    {
+      g_autoptr(GFileInputStream) stream = NULL;
+
+      stream = g_file_read (file, cancellable, NULL);
+      if (stream)
+        pixbuf = gdk_pixbuf_new_from_stream_at_scale (G_INPUT_STREAM (stream),
+                                                      PREVIEW_SIZE, PREVIEW_SIZE,
+                                                      TRUE,
+                                                      cancellable,
+                                                      NULL);
+      if (pixbuf)
+        {
+          g_autoptr(GdkPixbuf) tmp = NULL;
+
+          tmp = gdk_pixbuf_apply_embedded_orientation (pixbuf);
+          g_set_object (&pixbuf, tmp);
+        }
+    }
+
+  if (pixbuf)
+    preview_cache_insert (uri, mtime, pixbuf);
+
+  g_task_return_pointer (task, g_steal_pointer (&pixbuf), g_object_unref);
+}
+
+static void
+preview_loaded (GObject *source_object,
+                GAsyncResult *result,
+                gpointer data)
+{
+  GtkFileChooser *file_chooser = GTK_FILE_CHOOSER (source_object);
+  GtkWidget *preview = data;
+  g_autoptr(GdkPixbuf) pixbuf = NULL;
+  g_autoptr(GError) error = NULL;
+
+  pixbuf = g_task_propagate_pointer (G_TASK (result), &error);
+
+  /* The selection moved on, or the dialog went away */
+  if (g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+    {
+      g_object_unref (preview);
+      return;
+    }
+
+  gtk_image_set_from_pixbuf (GTK_IMAGE (preview), pixbuf);
+  gtk_file_chooser_set_preview_widget_active (file_chooser, pixbuf != NULL);
+
+  g_object_unref (preview);
+}
+
+static void
+cancel_preview (gpointer data)
+{
+  GCancellable *cancellable = data;
+
+  g_cancellable_cancel (cancellable);
+  g_object_unref (cancellable);
+}
+
 static void
 update_preview_cb (GtkFileChooser *file_chooser, gpointer data)
 {
   GtkWidget *preview = GTK_WIDGET (data);
   g_autofree char *filename = NULL;
-  g_autoptr(GdkPixbuf) pixbuf = NULL;
+  g_autoptr(GCancellable) cancellable = NULL;
+  g_autoptr(GTask) task = NULL;
+
+  /* Replacing the cancellable cancels the load for the previous selection */
+  g_object_set_data (G_OBJECT (file_chooser), "preview-cancellable", NULL);
 
   filename = gtk_file_chooser_get_preview_filename (file_chooser);
-  if (filename)
-    pixbuf = gdk_pixbuf_new_from_file_at_size (filename, 128, 128, NULL);
+  if (filename == NULL)
+    {
+      gtk_image_set_from_pixbuf (GTK_IMAGE (preview), NULL);
+      gtk_file_chooser_set_preview_widget_active (file_chooser, FALSE);
+      return;
+    }
 
-  if (pixbuf)
+  cancellable = g_cancellable_new ();
+  g_object_set_data_full (G_OBJECT (file_chooser), "preview-cancellable",
+                          g_object_ref (cancellable), cancel_preview);
+
+  task = g_task_new (file_chooser, cancellable, preview_loaded, g_object_ref (preview));
+  g_task_set_task_data (task, g_file_new_for_path (filename), g_object_unref);
+  g_task_run_in_thread (task, load_preview_thread);
+}
+
+/* Constructing a file chooser is the slowest part of a request: GTK sets
+ * up the places sidebar, loads bookmarks and mounts, and so on. Keep a few
+ * hidden dialogs per display that were built when the portal was idle, so
+ * a request only has to configure one. Pooled dialogs have never been
+ * shown; once used, a dialog is destroyed and the pool is refilled, so
+ * nothing carries over from one request to the next.
+ */
+#define DIALOG_POOL_SIZE 2
+
+typedef struct {
+  GtkWidget *fake_parent;
+  GtkWidget *dialog;
+} PooledDialog;
+
+static GHashTable *dialog_pools;
+static guint refill_id;
+
+static PooledDialog *
+pooled_dialog_new (GdkDisplay *display)
+{
+  PooledDialog *pooled;
+  GtkWidget *preview;
+
+  pooled = g_new0 (PooledDialog, 1);
+
+  pooled->fake_parent = g_object_new (GTK_TYPE_WINDOW,
+                                      "type", GTK_WINDOW_TOPLEVEL,
+                                      "screen", gdk_display_get_default_screen (display),
+                                      NULL);
+  g_object_ref_sink (pooled->fake_parent);
+
+  pooled->dialog = g_object_new (GTK_TYPE_FILE_CHOOSER_DIALOG,
+                                 "transient-for", pooled->fake_parent,
+                                 NULL);
+  g_object_ref (pooled->dialog);
+
+  preview = gtk_image_new ();
+  g_object_set (preview, "margin", 10, NULL);
+  gtk_widget_show (preview);
+  gtk_file_chooser_set_preview_widget (GTK_FILE_CHOOSER (pooled->dialog), preview);
+  gtk_file_chooser_set_preview_widget_active (GTK_FILE_CHOOSER (pooled->dialog), FALSE);
+  gtk_file_chooser_set_use_preview_label (GTK_FILE_CHOOSER (pooled->dialog), FALSE);
+  g_signal_connect (pooled->dialog, "update-preview", G_CALLBACK (update_preview_cb), preview);
+
+  return pooled;
+}
+
+static void
+pooled_dialog_free (gpointer data)
+{
+  PooledDialog *pooled = data;
+
+  gtk_widget_destroy (pooled->dialog);
+  g_object_unref (pooled->dialog);
+  g_object_unref (pooled->fake_parent);
+
+  g_free (pooled);
+}
+
+static void
+dialog_pool_free (gpointer data)
+{
+  g_queue_free_full (data, pooled_dialog_free);
+}
+
+static void
+display_closed (GdkDisplay *display,
+                gboolean is_error,
+                gpointer data)
+{
+  g_hash_table_remove (dialog_pools, display);
+}
+
+static GQueue *
+get_dialog_pool (GdkDisplay *display)
+{
+  GQueue *pool;
+
+  if (dialog_pools == NULL)
+    dialog_pools = g_hash_table_new_full (NULL, NULL, NULL, dialog_pool_free);
+
+  pool = g_hash_table_lookup (dialog_pools, display);
+  if (pool == NULL)
     {
-      g_autoptr(GdkPixbuf) tmp = NULL;
+      pool = g_queue_new ();
+      g_hash_table_insert (dialog_pools, display, pool);
+      g_signal_connect (display, "closed", G_CALLBACK (display_closed), NULL);
+    }
+
+  return pool;
+}
+
+/* Builds one dialog per iteration, to keep each one short */
+static gboolean
+refill_dialog_pools (gpointer data)
+{
+  GHashTableIter iter;
+  GdkDisplay *display;
+  GQueue *pool;
 
-      tmp = gdk_pixbuf_apply_embedded_orientation (pixbuf);
-      g_set_object (&pixbuf, tmp);
+  g_hash_table_iter_init (&iter, dialog_pools);
+  while (g_hash_table_iter_next (&iter, (gpointer *)&display, (gpointer *)&pool))
+    {
+      if (pool->length < DIALOG_POOL_SIZE)
+        {
+          g_queue_push_tail (pool, pooled_dialog_new (display));
+          return G_SOURCE_CONTINUE;
+        }
     }
 
-  gtk_image_set_from_pixbuf (GTK_IMAGE (preview), pixbuf);
-  gtk_file_chooser_set_preview_widget_active (file_chooser, pixbuf != NULL);
+  refill_id = 0;
+  return G_SOURCE_REMOVE;
+}
+
+static void
+schedule_dialog_pool_refill (void)
+{
+  if (refill_id == 0)
+    refill_id = g_idle_add_full (G_PRIORITY_LOW, refill_dialog_pools, NULL, NULL);
+}
+
+static PooledDialog *
+take_pooled_dialog (GdkDisplay *display)
+{
+  PooledDialog *pooled;
+
+  pooled = g_queue_pop_head (get_dialog_pool (display));
+  if (pooled == NULL)
+    pooled = pooled_dialog_new (display);
+
+  schedule_dialog_pool_refill ();
+
+  return pooled;
+}
+
+/* Roughly what GtkFileChooserWidget asks for when it lists a folder */
+#define PREFETCH_ATTRIBUTES \
+  G_FILE_ATTRIBUTE_STANDARD_NAME "," \
+  G_FILE_ATTRIBUTE_STANDARD_DISPLAY_NAME "," \
+  G_FILE_ATTRIBUTE_STANDARD_TYPE "," \
+  G_FILE_ATTRIBUTE_STANDARD_IS_HIDDEN "," \
+  G_FILE_ATTRIBUTE_STANDARD_IS_BACKUP "," \
+  G_FILE_ATTRIBUTE_STANDARD_SIZE "," \
+  G_FILE_ATTRIBUTE_STANDARD_CONTENT_TYPE "," \
+  G_FILE_ATTRIBUTE_STANDARD_FAST_CONTENT_TYPE "," \
+  G_FILE_ATTRIBUTE_STANDARD_ICON "," \
+  G_FILE_ATTRIBUTE_TIME_MODIFIED "," \
+  G_FILE_ATTRIBUTE_ACCESS_CAN_RENAME "," \
+  G_FILE_ATTRIBUTE_ACCESS_CAN_DELETE "," \
+  G_FILE_ATTRIBUTE_ACCESS_CAN_TRASH
+
+static void
+prefetch_next_files (GObject *source_object,
+                     GAsyncResult *result,
+                     gpointer data)
+{
+  GFileEnumerator *enumerator = G_FILE_ENUMERATOR (source_object);
+  GCancellable *cancellable = data;
+  GList *infos;
+
+  infos = g_file_enumerator_next_files_finish (enumerator, result, NULL);
+  if (infos == NULL)
+    {
+      g_object_unref (enumerator);
+      g_object_unref (cancellable);
+      return;
+    }
+
+  g_list_free_full (infos, g_object_unref);
+
+  g_file_enumerator_next_files_async (enumerator, 200, G_PRIORITY_LOW,
+                                      cancellable,
+                                      prefetch_next_files, cancellable);
+}
+
+static void
+prefetch_enumerated (GObject *source_object,
+                     GAsyncResult *result,
+                     gpointer data)
+{
+  GCancellable *cancellable = data;
+  GFileEnumerator *enumerator;
+
+  enumerator = g_file_enumerate_children_finish (G_FILE (source_object), result, NULL);
+  if (enumerator == NULL)
+    {
+      g_object_unref (cancellable);
+      return;
+    }
+
+  g_file_enumerator_next_files_async (enumerator, 200, G_PRIORITY_LOW,
+                                      cancellable,
+                                      prefetch_next_files, cancellable);
+}
+
+/* List the folder the dialog will open in while the dialog is being set
+ * up. The results are thrown away; the point is to get the dentry and
+ * page caches, and any FUSE or document portal backing store, warmed up
+ * before GTK lists the folder itself.
+ */
+static void
+prefetch_folder (const char *path,
+                 GCancellable *cancellable)
+{
+  g_autoptr(GFile) folder = g_file_new_for_path (path);
+
+  g_file_enumerate_children_async (folder,
+                                   PREFETCH_ATTRIBUTES,
+                                   G_FILE_QUERY_INFO_NONE,
+                                   G_PRIORITY_LOW,
+                                   cancellable,
+                                   prefetch_enumerated,
+                                   g_object_ref (cancellable));
 }
 
 static gboolean
@@ -414,7 +1100,7 @@ handle_open (XdpImplFileChooser *object,
   gboolean directory;
   gboolean modal;
   GdkDisplay *display;
-  GdkScreen *screen;
+  PooledDialog *pooled;
   GtkWidget *dialog;
   ExternalWindow *external_parent = NULL;
   GtkWidget *fake_parent;
@@ -427,7 +1113,7 @@ handle_open (XdpImplFileChooser *object,
   g_autoptr (GVariant) choices = NULL;
   g_autoptr (GVariant) current_filter = NULL;
   GSList *filters = NULL;
-  GtkWidget *preview;
+  g_autoptr(GCancellable) cancellable = NULL;
 
   method_name = g_dbus_method_invocation_get_method_name (invocation);
   sender = g_dbus_method_invocation_get_sender (invocation);
@@ -466,6 +1152,18 @@ handle_open (XdpImplFileChooser *object,
 
   cancel_label = _("_Cancel");
 
+  cancellable = g_cancellable_new ();
+
+  if (g_variant_lookup (arg_options, "current_folder", "^&ay", &path))
+    prefetch_folder (path, cancellable);
+  else if (strcmp (method_name, "SaveFile") == 0 &&
+           g_variant_lookup (arg_options, "current_file", "^&ay", &path))
+    {
+      g_autofree char *dir = g_path_get_dirname (path);
+
+      prefetch_folder (dir, cancellable);
+    }
+
   if (arg_parent_window)
     {
       external_parent = create_external_window_from_handle (arg_parent_window);
@@ -478,39 +1176,33 @@ handle_open (XdpImplFileChooser *object,
     display = external_window_get_display (external_parent);
   else
     display = gdk_display_get_default ();
-  screen = gdk_display_get_default_screen (display);
-
-  fake_parent = g_object_new (GTK_TYPE_WINDOW,
-                              "type", GTK_WINDOW_TOPLEVEL,
-                              "screen", screen,
-                              NULL);
-  g_object_ref_sink (fake_parent);
-
-  dialog = gtk_file_chooser_dialog_new (arg_title, GTK_WINDOW (fake_parent), action,
-                                        cancel_label, GTK_RESPONSE_CANCEL,
-                                        accept_label, GTK_RESPONSE_OK,
-                                        NULL);
+
+  /* Take over the pool's references */
+  pooled = take_pooled_dialog (display);
+  fake_parent = pooled->fake_parent;
+  dialog = pooled->dialog;
+  g_free (pooled);
+
+  gtk_window_set_title (GTK_WINDOW (dialog), arg_title);
+  gtk_file_chooser_set_action (GTK_FILE_CHOOSER (dialog), action);
+  gtk_dialog_add_button (GTK_DIALOG (dialog), cancel_label, GTK_RESPONSE_CANCEL);
+  gtk_dialog_add_button (GTK_DIALOG (dialog), accept_label, GTK_RESPONSE_OK);
   gtk_window_set_modal (GTK_WINDOW (dialog), modal);
 
   gtk_dialog_set_default_response (GTK_DIALOG (dialog), GTK_RESPONSE_OK);
   gtk_file_chooser_set_select_multiple (GTK_FILE_CHOOSER (dialog), multiple);
 
-  preview = gtk_image_new ();
-  g_object_set (preview, "margin", 10, NULL);
-  gtk_widget_show (preview);
-  gtk_file_chooser_set_preview_widget (GTK_FILE_CHOOSER (dialog), preview);
-  gtk_file_chooser_set_preview_widget_active (GTK_FILE_CHOOSER (dialog), FALSE);
-  gtk_file_chooser_set_use_preview_label (GTK_FILE_CHOOSER (dialog), FALSE);
-  g_signal_connect (dialog, "update-preview", G_CALLBACK (update_preview_cb), preview);
-
   handle = g_new0 (FileDialogHandle, 1);
   handle->impl = object;
   handle->invocation = invocation;
   handle->request = g_object_ref (request);
-  handle->dialog = g_object_ref (dialog);
+  handle->dialog = dialog;
   handle->action = action;
   handle->multiple = multiple;
   handle->choices = g_hash_table_new (g_str_hash, g_str_equal);
+  handle->files = g_ptr_array_new_with_free_func (g_free);
+  handle->uris = g_ptr_array_new_with_free_func (g_free);
+  handle->cancellable = g_object_ref (cancellable);
   handle->external_parent = external_parent;
   handle->allow_write = TRUE;
 
@@ -543,7 +1235,7 @@ handle_open (XdpImplFileChooser *object,
         {
           GtkFileFilter *filter;
 
-          filter = gtk_file_filter_new_from_gvariant (variant);
+          filter = file_filter_new_from_gvariant (variant);
           filters = g_slist_append (filters, g_object_ref (filter));
           gtk_file_chooser_add_filter (GTK_FILE_CHOOSER (dialog), filter);
           g_variant_unref (variant);
@@ -556,7 +1248,7 @@ handle_open (XdpImplFileChooser *object,
       g_autoptr (GtkFileFilter) filter = NULL;
       const char *current_filter_name;
 
-      filter = g_object_ref_sink (gtk_file_filter_new_from_gvariant (current_filter));
+      filter = g_object_ref_sink (file_filter_new_from_gvariant (current_filter));
       current_filter_name = gtk_file_filter_get_name (filter);
 
       if (!filters)
@@ -626,7 +1318,7 @@ handle_open (XdpImplFileChooser *object,
         {
           char *file = NULL;
           while (g_variant_iter_next (iter, "^ay", &file))
-            handle->files = g_slist_append (handle->files, file);
+            g_ptr_array_add (handle->files, file);
 
           g_variant_iter_free (iter);
         }
@@ -668,6 +1360,13 @@ handle_open (XdpImplFileChooser *object,
   return TRUE;
 }
 
+void
+file_chooser_set_no_recent_apps (const char * const *app_ids)
+{
+  g_strfreev (no_recent_apps);
+  no_recent_apps = g_strdupv ((char **) app_ids);
+}
+
 gboolean
 file_chooser_init (GDBusConnection *bus,
                    GError **error)
@@ -688,5 +1387,11 @@ file_chooser_init (GDBusConnection *bus,
 
   g_debug ("providing %s", g_dbus_interface_skeleton_get_info (helper)->name);
 
+  if (gdk_display_get_default ())
+    {
+      get_dialog_pool (gdk_display_get_default ());
+      schedule_dialog_pool_refill ();
+    }
+
   return TRUE;
 }
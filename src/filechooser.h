@@ -23,3 +23,5 @@
 #include <gio/gio.h>
 
 gboolean file_chooser_init (GDBusConnection *bus, GError **error);
+
+void file_chooser_set_no_recent_apps (const char * const *app_ids);
@@ -0,0 +1,285 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include <fnmatch.h>
+#include <string.h>
+
+#include <gtk/gtk.h>
+
+#include "filefilter.h"
+#include "gtkbackports.h"
+
+/* GtkFileFilter checks its rules one by one for every file. That is fine
+ * for a handful of rules, but some apps send hundreds of them, and large
+ * folders then take a long time to list. Such filters are compiled into
+ * hash sets instead and installed as a single custom rule:
+ *
+ * - "*.ext" patterns become a set of suffixes
+ * - "*.[eE][xX][tT]" patterns, the case-insensitive form that apps
+ *   generate, become a set of lowercase suffixes
+ * - MIME types are checked with g_content_type_is_a() like GTK does, so
+ *   subclasses match, and the answer is remembered per MIME type
+ * - everything else is matched with fnmatch() like GTK does
+ */
+#define COMPILE_THRESHOLD 16
+
+typedef struct {
+  GHashTable *suffixes;
+  GHashTable *folded_suffixes;
+  GPtrArray *patterns;
+  GHashTable *mime_types;
+  GHashTable *mime_matches;
+} CompiledFilter;
+
+static void
+compiled_filter_free (gpointer data)
+{
+  CompiledFilter *compiled = data;
+
+  g_hash_table_unref (compiled->suffixes);
+  g_hash_table_unref (compiled->folded_suffixes);
+  g_ptr_array_unref (compiled->patterns);
+  g_hash_table_unref (compiled->mime_types);
+  g_hash_table_unref (compiled->mime_matches);
+
+  g_free (compiled);
+}
+
+/* Returns the suffix for "*.suffix" and "*.[sS][uU][fF]..." patterns,
+ * or NULL if the pattern needs to be matched as a glob.
+ */
+static char *
+parse_suffix_pattern (const char *pattern,
+                      gboolean *folded)
+{
+  g_autoptr(GString) suffix = NULL;
+  gboolean has_brackets = FALSE;
+  gboolean has_letters = FALSE;
+  const char *p;
+
+  if (!g_str_has_prefix (pattern, "*."))
+    return NULL;
+
+  suffix = g_string_new (NULL);
+
+  for (p = pattern + 2; *p; p++)
+    {
+      if (*p == '[')
+        {
+          if (p[1] == '\0' || p[2] == '\0' || p[3] != ']' ||
+              p[1] == p[2] || g_ascii_tolower (p[1]) != g_ascii_tolower (p[2]))
+            return NULL;
+
+          g_string_append_c (suffix, g_ascii_tolower (p[1]));
+          has_brackets = TRUE;
+          p += 3;
+        }
+      else if (*p == '*' || *p == '?' || *p == '\\' || *p == ']')
+        return NULL;
+      else
+        {
+          if (g_ascii_isalpha (*p))
+            has_letters = TRUE;
+          g_string_append_c (suffix, *p);
+        }
+    }
+
+  /* Something like "*.[jJ]peg" is neither case-sensitive nor not */
+  if (suffix->len == 0 || (has_brackets && has_letters))
+    return NULL;
+
+  *folded = has_brackets;
+
+  return g_string_free (g_steal_pointer (&suffix), FALSE);
+}
+
+static gboolean
+match_suffix (GHashTable *suffixes,
+              const char *name)
+{
+  const char *dot;
+
+  for (dot = strchr (name, '.'); dot; dot = strchr (dot + 1, '.'))
+    {
+      if (g_hash_table_contains (suffixes, dot + 1))
+        return TRUE;
+    }
+
+  return FALSE;
+}
+
+static gboolean
+match_name (CompiledFilter *compiled,
+            const char *name)
+{
+  guint i;
+
+  if (match_suffix (compiled->suffixes, name))
+    return TRUE;
+
+  if (g_hash_table_size (compiled->folded_suffixes) > 0)
+    {
+      g_autofree char *folded = g_ascii_strdown (name, -1);
+
+      if (match_suffix (compiled->folded_suffixes, folded))
+        return TRUE;
+    }
+
+  for (i = 0; i < compiled->patterns->len; i++)
+    {
+      if (fnmatch (g_ptr_array_index (compiled->patterns, i), name, 0) == 0)
+        return TRUE;
+    }
+
+  return FALSE;
+}
+
+static gboolean
+match_mime_type (CompiledFilter *compiled,
+                 const char *mime_type)
+{
+  GHashTableIter iter;
+  gpointer key;
+  gpointer cached;
+  gboolean matches = FALSE;
+
+  if (g_hash_table_contains (compiled->mime_types, mime_type))
+    return TRUE;
+
+  if (g_hash_table_lookup_extended (compiled->mime_matches, mime_type, NULL, &cached))
+    return GPOINTER_TO_INT (cached);
+
+  g_hash_table_iter_init (&iter, compiled->mime_types);
+  while (g_hash_table_iter_next (&iter, &key, NULL))
+    {
+      if (g_content_type_is_a (mime_type, key))
+        {
+          matches = TRUE;
+          break;
+        }
+    }
+
+  g_hash_table_insert (compiled->mime_matches, g_strdup (mime_type), GINT_TO_POINTER (matches));
+
+  return matches;
+}
+
+static gboolean
+compiled_filter_func (const GtkFileFilterInfo *info,
+                      gpointer data)
+{
+  CompiledFilter *compiled = data;
+
+  if ((info->contains & GTK_FILE_FILTER_DISPLAY_NAME) && info->display_name &&
+      match_name (compiled, info->display_name))
+    return TRUE;
+
+  if ((info->contains & GTK_FILE_FILTER_MIME_TYPE) && info->mime_type &&
+      match_mime_type (compiled, info->mime_type))
+    return TRUE;
+
+  return FALSE;
+}
+
+static GtkFileFilter *
+compile_filter (const char *name,
+                GVariant *rules)
+{
+  GtkFileFilter *filter;
+  CompiledFilter *compiled;
+  GtkFileFilterFlags needed = 0;
+  GVariantIter iter;
+  guint32 type;
+  const char *rule;
+
+  compiled = g_new0 (CompiledFilter, 1);
+  compiled->suffixes = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+  compiled->folded_suffixes = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+  compiled->patterns = g_ptr_array_new_with_free_func (g_free);
+  compiled->mime_types = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+  compiled->mime_matches = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+
+  g_variant_iter_init (&iter, rules);
+  while (g_variant_iter_next (&iter, "(u&s)", &type, &rule))
+    {
+      switch (type)
+        {
+        case 0:
+          {
+            gboolean folded;
+            char *suffix;
+
+            suffix = parse_suffix_pattern (rule, &folded);
+            if (suffix == NULL)
+              g_ptr_array_add (compiled->patterns, g_strdup (rule));
+            else if (folded)
+              g_hash_table_add (compiled->folded_suffixes, suffix);
+            else
+              g_hash_table_add (compiled->suffixes, suffix);
+
+            needed |= GTK_FILE_FILTER_DISPLAY_NAME;
+          }
+          break;
+        case 1:
+          g_hash_table_add (compiled->mime_types, g_strdup (rule));
+          needed |= GTK_FILE_FILTER_MIME_TYPE;
+          break;
+        default:
+          break;
+        }
+    }
+
+  filter = gtk_file_filter_new ();
+  gtk_file_filter_set_name (filter, name);
+  gtk_file_filter_add_custom (filter, needed, compiled_filter_func, compiled, compiled_filter_free);
+
+  return filter;
+}
+
+GtkFileFilter *
+file_filter_new_from_gvariant (GVariant *variant)
+{
+  GtkFileFilter *filter;
+  g_autoptr(GVariant) rules = NULL;
+  const char *name;
+
+  g_variant_get (variant, "(&s@a(us))", &name, &rules);
+
+  if (g_variant_n_children (rules) < COMPILE_THRESHOLD)
+    return gtk_file_filter_new_from_gvariant (variant);
+
+  filter = compile_filter (name, rules);
+
+  /* A custom rule can't be serialized, so remember what the app sent */
+  g_object_set_data_full (G_OBJECT (filter), "portal-filter",
+                          g_variant_ref_sink (variant), (GDestroyNotify) g_variant_unref);
+
+  return filter;
+}
+
+/* Unlike gtk_file_filter_to_gvariant(), returns a full reference */
+GVariant *
+file_filter_to_gvariant (GtkFileFilter *filter)
+{
+  GVariant *variant;
+
+  variant = g_object_get_data (G_OBJECT (filter), "portal-filter");
+  if (variant)
+    return g_variant_ref (variant);
+
+  return g_variant_ref_sink (gtk_file_filter_to_gvariant (filter));
+}
@@ -24,6 +24,7 @@ enum {
 static GDBusInterfaceSkeleton *inhibit;
 static OrgGnomeSessionManager *sessionmanager;
 static OrgGnomeScreenSaver *screensaver;
+static OrgFreedesktopScreenSaver *fdo_screensaver;
 static GDBusProxy *client;
 
 typedef enum {
@@ -37,6 +38,42 @@ static SessionState session_state = RUNNING;
 static gboolean screensaver_active = FALSE;
 static guint query_end_timeout;
 
+/* Apps tend to toggle inhibition a lot, e.g. video players on every
+ * play/pause. Rather than forwarding each request, requests with the
+ * same app and flags share a single inhibitor upstream. It is taken when
+ * the first request comes in, and given back a little while after the
+ * last one is closed, so that quick toggles don't reach the session
+ * manager at all. The reason of the first request is the one used.
+ */
+#define INHIBITOR_RELEASE_DELAY 2000
+
+typedef struct {
+  char *key;
+  char *app_id;
+  char *reason;
+  guint flags;
+  guint ref_count;
+  guint cookie;
+  gboolean pending;
+  guint release_id;
+} Inhibitor;
+
+static GHashTable *inhibitors;
+
+static void
+inhibitor_free (gpointer data)
+{
+  Inhibitor *inhibitor = data;
+
+  if (inhibitor->release_id)
+    g_source_remove (inhibitor->release_id);
+
+  g_free (inhibitor->key);
+  g_free (inhibitor->app_id);
+  g_free (inhibitor->reason);
+  g_free (inhibitor);
+}
+
 static void
 uninhibit_done_gnome (GObject *source,
                       GAsyncResult *result,
@@ -48,29 +85,65 @@ uninhibit_done_gnome (GObject *source,
     g_warning ("Backend call failed: %s", error->message);
 }
 
-static gboolean
-handle_close_gnome (XdpImplRequest *object,
-                    GDBusMethodInvocation *invocation,
+static void
+uninhibit_done_fdo (GObject *source,
+                    GAsyncResult *result,
                     gpointer data)
 {
-  Request *request = (Request *)object;
-  guint cookie;
+  g_autoptr(GError) error = NULL;
 
-  /* If we get a Close call before the Inhibit call returned,
-   * delay the uninhibit call until we have the cookie.
-   */
-  cookie = GPOINTER_TO_UINT (g_object_get_data (G_OBJECT (request), "cookie"));
-  if (cookie)
-    org_gnome_session_manager_call_uninhibit (sessionmanager, cookie, NULL, uninhibit_done_gnome, NULL);
+  if (!org_freedesktop_screen_saver_call_un_inhibit_finish (fdo_screensaver,
+                                                            result,
+                                                            &error))
+    g_warning ("Backend call failed: %s", error->message);
+}
+
+static void
+call_uninhibit (guint cookie)
+{
+  if (sessionmanager)
+    org_gnome_session_manager_call_uninhibit (sessionmanager,
+                                              cookie,
+                                              NULL,
+                                              uninhibit_done_gnome,
+                                              NULL);
   else
-    g_object_set_data (G_OBJECT (request), "closed", GINT_TO_POINTER (1));
+    org_freedesktop_screen_saver_call_un_inhibit (fdo_screensaver,
+                                                  cookie,
+                                                  NULL,
+                                                  uninhibit_done_fdo,
+                                                  NULL);
+}
 
-  if (request->exported)
-    request_unexport (request);
+/* Drops the upstream inhibitor, unless it is still being taken; in that
+ * case this happens once the cookie arrives.
+ */
+static void
+inhibitor_drop (Inhibitor *inhibitor)
+{
+  if (inhibitor->pending)
+    return;
 
-  xdp_impl_request_complete_close (object, invocation);
+  g_debug ("Releasing inhibitor %s", inhibitor->key);
 
-  return TRUE;
+  if (inhibitor->cookie)
+    call_uninhibit (inhibitor->cookie);
+
+  g_hash_table_remove (inhibitors, inhibitor->key);
+}
+
+static void
+inhibitor_inhibited (Inhibitor *inhibitor,
+                     guint cookie)
+{
+  inhibitor->pending = FALSE;
+  inhibitor->cookie = cookie;
+
+  /* If all requests were closed before the Inhibit call returned,
+   * and the grace period is over, give it back right away.
+   */
+  if (inhibitor->ref_count == 0 && inhibitor->release_id == 0)
+    inhibitor_drop (inhibitor);
 }
 
 static void
@@ -78,57 +151,345 @@ inhibit_done_gnome (GObject *source,
                     GAsyncResult *result,
                     gpointer data)
 {
-  g_autoptr(Request) request = data;
+  Inhibitor *inhibitor = data;
   guint cookie = 0;
-  gboolean closed;
   g_autoptr(GError) error = NULL;
 
   if (!org_gnome_session_manager_call_inhibit_finish (sessionmanager, &cookie, result, &error))
     g_warning ("Backend call failed: %s", error->message);
 
-  closed = GPOINTER_TO_UINT (g_object_get_data (G_OBJECT (request), "closed"));
+  inhibitor_inhibited (inhibitor, cookie);
+}
+
+static void
+inhibit_done_fdo (GObject *source,
+                  GAsyncResult *result,
+                  gpointer data)
+{
+  Inhibitor *inhibitor = data;
+  guint cookie = 0;
+  g_autoptr(GError) error = NULL;
+
+  if (!org_freedesktop_screen_saver_call_inhibit_finish (fdo_screensaver,
+                                                         &cookie,
+                                                         result,
+                                                         &error))
+    g_warning ("Backend call failed: %s", error->message);
+
+  inhibitor_inhibited (inhibitor, cookie);
+}
+
+static gboolean
+inhibitor_release_timeout (gpointer data)
+{
+  Inhibitor *inhibitor = data;
+
+  inhibitor->release_id = 0;
+  inhibitor_drop (inhibitor);
+
+  return G_SOURCE_REMOVE;
+}
+
+static Inhibitor *
+inhibitor_acquire (const char *app_id,
+                   guint flags,
+                   const char *reason)
+{
+  g_autofree char *key = NULL;
+  Inhibitor *inhibitor;
+
+  if (inhibitors == NULL)
+    inhibitors = g_hash_table_new_full (g_str_hash, g_str_equal, NULL, inhibitor_free);
+
+  key = g_strdup_printf ("%u:%s", flags, app_id);
+  inhibitor = g_hash_table_lookup (inhibitors, key);
+  if (inhibitor == NULL)
+    {
+      inhibitor = g_new0 (Inhibitor, 1);
+      inhibitor->key = g_steal_pointer (&key);
+      inhibitor->app_id = g_strdup (app_id);
+      inhibitor->reason = g_strdup (reason);
+      inhibitor->flags = flags;
+      g_hash_table_insert (inhibitors, inhibitor->key, inhibitor);
+    }
+
+  inhibitor->ref_count++;
 
-  if (closed)
-    org_gnome_session_manager_call_uninhibit (sessionmanager, cookie, NULL, uninhibit_done_gnome, NULL);
+  if (inhibitor->release_id)
+    {
+      g_source_remove (inhibitor->release_id);
+      inhibitor->release_id = 0;
+    }
+
+  if (inhibitor->cookie == 0 && !inhibitor->pending)
+    {
+      g_debug ("Taking inhibitor %s", inhibitor->key);
+
+      inhibitor->pending = TRUE;
+
+      if (sessionmanager)
+        org_gnome_session_manager_call_inhibit (sessionmanager,
+                                                inhibitor->app_id,
+                                                0, /* window */
+                                                inhibitor->reason,
+                                                inhibitor->flags,
+                                                NULL,
+                                                inhibit_done_gnome,
+                                                inhibitor);
+      else
+        org_freedesktop_screen_saver_call_inhibit (fdo_screensaver,
+                                                   inhibitor->app_id,
+                                                   inhibitor->reason,
+                                                   NULL,
+                                                   inhibit_done_fdo,
+                                                   inhibitor);
+    }
+
+  return inhibitor;
+}
+
+/* If immediately is set, the grace period is skipped */
+static void
+inhibitor_release (Inhibitor *inhibitor,
+                   gboolean immediately)
+{
+  g_assert (inhibitor->ref_count > 0);
+
+  if (--inhibitor->ref_count > 0)
+    return;
+
+  if (immediately)
+    inhibitor_drop (inhibitor);
   else
-    g_object_set_data (G_OBJECT (request), "cookie", GUINT_TO_POINTER (cookie));
+    inhibitor->release_id = g_timeout_add (INHIBITOR_RELEASE_DELAY,
+                                           inhibitor_release_timeout,
+                                           inhibitor);
+}
+
+/* Inhibit requests are tracked by the bus peer that made them, which
+ * normally is the portal frontend. It closes the requests of apps that
+ * go away, but if the peer itself goes away without closing them, this
+ * makes sure nothing is left inhibiting.
+ */
+typedef struct {
+  char *name;
+  guint watch_id;
+  GHashTable *requests;
+} InhibitPeer;
+
+static GHashTable *peers;
+
+static void
+inhibit_peer_free (gpointer data)
+{
+  InhibitPeer *peer = data;
+
+  g_bus_unwatch_name (peer->watch_id);
+  g_hash_table_unref (peer->requests);
+  g_free (peer->name);
+  g_free (peer);
+}
+
+static void
+peer_vanished (GDBusConnection *connection,
+               const char *name,
+               gpointer data)
+{
+  InhibitPeer *peer;
+  GHashTableIter iter;
+  Request *request;
+
+  peer = g_hash_table_lookup (peers, name);
+  if (peer == NULL)
+    return;
+
+  g_debug ("%s vanished, releasing its %u inhibit requests",
+           name, g_hash_table_size (peer->requests));
+
+  /* The Uninhibit calls are all sent before any reply is waited for */
+  g_hash_table_iter_init (&iter, peer->requests);
+  while (g_hash_table_iter_next (&iter, (gpointer *)&request, NULL))
+    {
+      Inhibitor *inhibitor;
+
+      inhibitor = g_object_steal_data (G_OBJECT (request), "inhibitor");
+      if (inhibitor)
+        inhibitor_release (inhibitor, TRUE);
+
+      g_hash_table_iter_remove (&iter);
+
+      if (request->exported)
+        request_unexport (request);
+    }
+
+  g_hash_table_remove (peers, name);
+}
+
+static void
+track_request (Request *request,
+               GDBusConnection *connection)
+{
+  InhibitPeer *peer;
+
+  if (peers == NULL)
+    peers = g_hash_table_new_full (g_str_hash, g_str_equal, NULL, inhibit_peer_free);
+
+  peer = g_hash_table_lookup (peers, request->sender);
+  if (peer == NULL)
+    {
+      peer = g_new0 (InhibitPeer, 1);
+      peer->name = g_strdup (request->sender);
+      peer->requests = g_hash_table_new (NULL, NULL);
+      g_hash_table_insert (peers, peer->name, peer);
+
+      peer->watch_id = g_bus_watch_name_on_connection (connection,
+                                                       peer->name,
+                                                       G_BUS_NAME_WATCHER_FLAGS_NONE,
+                                                       NULL,
+                                                       peer_vanished,
+                                                       NULL, NULL);
+    }
+
+  g_hash_table_add (peer->requests, request);
+}
+
+static void
+untrack_request (Request *request)
+{
+  InhibitPeer *peer;
+
+  if (peers == NULL)
+    return;
+
+  peer = g_hash_table_lookup (peers, request->sender);
+  if (peer == NULL)
+    return;
+
+  g_hash_table_remove (peer->requests, request);
+  if (g_hash_table_size (peer->requests) == 0)
+    g_hash_table_remove (peers, peer->name);
+}
+
+/* Logs the live inhibitors and the peers holding them */
+void
+inhibit_dump_state (void)
+{
+  GHashTableIter iter;
+  Inhibitor *inhibitor;
+  InhibitPeer *peer;
+
+  g_debug ("%u inhibitors:", inhibitors ? g_hash_table_size (inhibitors) : 0);
+
+  if (inhibitors)
+    {
+      g_hash_table_iter_init (&iter, inhibitors);
+      while (g_hash_table_iter_next (&iter, NULL, (gpointer *)&inhibitor))
+        g_debug ("  %s flags %u: %u requests, cookie %u%s%s, reason '%s'",
+                 inhibitor->app_id,
+                 inhibitor->flags,
+                 inhibitor->ref_count,
+                 inhibitor->cookie,
+                 inhibitor->pending ? ", inhibiting" : "",
+                 inhibitor->release_id ? ", releasing" : "",
+                 inhibitor->reason);
+    }
+
+  g_debug ("%u peers:", peers ? g_hash_table_size (peers) : 0);
+
+  if (peers)
+    {
+      g_hash_table_iter_init (&iter, peers);
+      while (g_hash_table_iter_next (&iter, NULL, (gpointer *)&peer))
+        g_debug ("  %s: %u requests", peer->name, g_hash_table_size (peer->requests));
+    }
 }
 
 static gboolean
-handle_inhibit_gnome (XdpImplInhibit *object,
-                      GDBusMethodInvocation *invocation,
-                      const gchar *arg_handle,
-                      const gchar *arg_app_id,
-                      const gchar *arg_window,
-                      guint arg_flags,
-                      GVariant *arg_options)
+handle_close (XdpImplRequest *object,
+              GDBusMethodInvocation *invocation,
+              gpointer data)
+{
+  Request *request = (Request *)object;
+  Inhibitor *inhibitor;
+
+  inhibitor = g_object_steal_data (G_OBJECT (request), "inhibitor");
+  if (inhibitor)
+    inhibitor_release (inhibitor, FALSE);
+
+  untrack_request (request);
+
+  if (request->exported)
+    request_unexport (request);
+
+  xdp_impl_request_complete_close (object, invocation);
+
+  return TRUE;
+}
+
+static void
+start_inhibit (XdpImplInhibit *object,
+               GDBusMethodInvocation *invocation,
+               const gchar *arg_handle,
+               const gchar *arg_app_id,
+               guint arg_flags,
+               GVariant *arg_options)
 {
   g_autoptr (Request) request = NULL;
   const char *sender;
-  g_autoptr(GError) error = NULL;
   const char *reason;
+  Inhibitor *inhibitor;
 
   sender = g_dbus_method_invocation_get_sender (invocation);
 
   request = request_new (sender, arg_app_id, arg_handle);
 
-  g_signal_connect (request, "handle-close", G_CALLBACK (handle_close_gnome), NULL);
+  g_signal_connect (request, "handle-close", G_CALLBACK (handle_close), NULL);
 
   request_export (request, g_dbus_method_invocation_get_connection (invocation));
+  track_request (request, g_dbus_method_invocation_get_connection (invocation));
 
   if (!g_variant_lookup (arg_options, "reason", "&s", &reason))
     reason = "";
 
-  org_gnome_session_manager_call_inhibit (sessionmanager,
-                                          arg_app_id,
-                                          0, /* window */
-                                          reason,
-                                          arg_flags,
-                                          NULL,
-                                          inhibit_done_gnome,
-                                          g_object_ref (request));
+  inhibitor = inhibitor_acquire (arg_app_id, arg_flags, reason);
+  g_object_set_data (G_OBJECT (request), "inhibitor", inhibitor);
 
   xdp_impl_inhibit_complete_inhibit (object, invocation);
+}
+
+static gboolean
+handle_inhibit_gnome (XdpImplInhibit *object,
+                      GDBusMethodInvocation *invocation,
+                      const gchar *arg_handle,
+                      const gchar *arg_app_id,
+                      const gchar *arg_window,
+                      guint arg_flags,
+                      GVariant *arg_options)
+{
+  start_inhibit (object, invocation, arg_handle, arg_app_id, arg_flags, arg_options);
+
+  return TRUE;
+}
+
+static gboolean
+handle_inhibit_fdo (XdpImplInhibit *object,
+                    GDBusMethodInvocation *invocation,
+                    const gchar *arg_handle,
+                    const gchar *arg_app_id,
+                    const gchar *arg_window,
+                    guint arg_flags,
+                    GVariant *arg_options)
+{
+  if ((arg_flags & ~INHIBIT_IDLE) != 0)
+    {
+      g_dbus_method_invocation_return_error (invocation,
+                                             XDG_DESKTOP_PORTAL_ERROR,
+                                             XDG_DESKTOP_PORTAL_ERROR_FAILED,
+                                             "Inhibiting other than idle not supported");
+      return TRUE;
+    }
+
+  start_inhibit (object, invocation, arg_handle, arg_app_id, INHIBIT_IDLE, arg_options);
 
   return TRUE;
 }
@@ -164,7 +525,8 @@ set_session_state (SessionState state)
   global_emit_state_changed ();
 }
 
-static void global_set_pending_query_end_response (gboolean pending);
+static void global_start_query_end (void);
+static void global_stop_query_end (void);
 static gboolean global_get_pending_query_end_response (void);
 
 static void
@@ -178,7 +540,7 @@ stop_waiting_for_query_end_response (gboolean send_response)
       query_end_timeout = 0;
     }
 
-  global_set_pending_query_end_response (FALSE);
+  global_stop_query_end ();
 
   if (send_response && client)
     send_quit_response (client, TRUE, NULL);
@@ -203,8 +565,8 @@ wait_for_query_end_response (GDBusProxy *proxy)
   g_debug ("Waiting for up to 1 second for QueryEndResponse calls");
 
   query_end_timeout = g_timeout_add (1000, query_end_response, proxy);
-  
-  global_set_pending_query_end_response (TRUE);
+
+  global_start_query_end ();
 }
 
 static void
@@ -257,152 +619,109 @@ client_proxy_signal (GDBusProxy  *proxy,
     }
 }
 
-static OrgFreedesktopScreenSaver *fdo_screensaver;
-
-static void
-uninhibit_done_fdo (GObject *source,
-                    GAsyncResult *result,
-                    gpointer data)
-{
-  g_autoptr(GError) error = NULL;
-
-  if (!org_freedesktop_screen_saver_call_un_inhibit_finish (fdo_screensaver,
-                                                            result,
-                                                            &error))
-    g_warning ("Backend call failed: %s", error->message);
-}
-
-static gboolean
-handle_close_fdo (XdpImplRequest *object,
-                  GDBusMethodInvocation *invocation,
-                  gpointer data)
+/* Monitor sessions, by id. The StateChanged payload is the same for
+ * all of them, so it is built once per change. Screensaver flaps are
+ * coalesced; session state changes go out right away, since logout
+ * waits for them.
+ */
+#define STATE_CHANGED_DELAY 100
+
+static GHashTable *active_sessions;
+
+static GVariant *state;
+static gboolean state_screensaver_active;
+static SessionState state_session_state;
+static guint state_changed_id;
+
+/* What all sessions were last told. Not the same as the cached payload,
+ * which is also built for sessions that just got created.
+ */
+static gboolean broadcast_valid;
+static gboolean broadcast_screensaver_active;
+static SessionState broadcast_session_state;
+
+static GVariant *
+get_state (void)
 {
-  Request *request = (Request *)object;
-  guint cookie;
+  if (state &&
+      (state_screensaver_active != screensaver_active ||
+       state_session_state != session_state))
+    g_clear_pointer (&state, g_variant_unref);
 
-  /* If we get a Close call before the Inhibit call returned,
-   * delay the uninhibit call until we have the cookie.
-   */
-  cookie = GPOINTER_TO_UINT (g_object_get_data (G_OBJECT (request), "cookie"));
-  if (cookie)
-    org_freedesktop_screen_saver_call_un_inhibit (fdo_screensaver,
-                                                  cookie,
-                                                  NULL,
-                                                  uninhibit_done_fdo,
-                                                  NULL);
-  else
-    g_object_set_data (G_OBJECT (request), "closed", GINT_TO_POINTER (1));
-
-  if (request->exported)
-    request_unexport (request);
-
-  xdp_impl_request_complete_close (object, invocation);
+  if (state == NULL)
+    {
+      GVariantBuilder builder;
+
+      g_variant_builder_init (&builder, G_VARIANT_TYPE_VARDICT);
+      g_variant_builder_add (&builder, "{sv}", "screensaver-active", g_variant_new_boolean (screensaver_active));
+      g_variant_builder_add (&builder, "{sv}", "session-state", g_variant_new_uint32 (session_state));
+      state = g_variant_ref_sink (g_variant_builder_end (&builder));
+      state_screensaver_active = screensaver_active;
+      state_session_state = session_state;
+    }
 
-  return TRUE;
+  return state;
 }
 
 static void
-inhibit_done_fdo (GObject *source,
-                  GAsyncResult *result,
-                  gpointer data)
+emit_state_changed (Session *session)
 {
-  g_autoptr(Request) request = data;
-  guint cookie = 0;
-  gboolean closed;
-  g_autoptr(GError) error = NULL;
-
-  if (!org_freedesktop_screen_saver_call_inhibit_finish (fdo_screensaver,
-                                                         &cookie,
-                                                         result,
-                                                         &error))
-    g_warning ("Backend call failed: %s", error->message);
-
-  closed = GPOINTER_TO_UINT (g_object_get_data (G_OBJECT (request), "closed"));
+  g_debug ("Emitting StateChanged for session %s", session->id);
 
-  if (closed)
-    org_freedesktop_screen_saver_call_un_inhibit (fdo_screensaver,
-                                                  cookie,
-                                                  NULL,
-                                                  uninhibit_done_fdo,
-                                                  NULL);
-  else
-    g_object_set_data (G_OBJECT (request), "cookie", GUINT_TO_POINTER (cookie));
+  g_signal_emit_by_name (inhibit, "state-changed", session->id, get_state ());
 }
 
-static gboolean
-handle_inhibit_fdo (XdpImplInhibit *object,
-                    GDBusMethodInvocation *invocation,
-                    const gchar *arg_handle,
-                    const gchar *arg_app_id,
-                    const gchar *arg_window,
-                    guint arg_flags,
-                    GVariant *arg_options)
+static void
+global_emit_state_changed (void)
 {
-  g_autoptr (Request) request = NULL;
-  const char *sender;
-  g_autoptr(GError) error = NULL;
-  const char *reason;
+  GHashTableIter iter;
+  Session *session;
 
-  if ((arg_flags & ~INHIBIT_IDLE) != 0)
+  if (state_changed_id != 0)
     {
-      g_dbus_method_invocation_return_error (invocation,
-                                             XDG_DESKTOP_PORTAL_ERROR,
-                                             XDG_DESKTOP_PORTAL_ERROR_FAILED,
-                                             "Inhibiting other than idle not supported");
-      return TRUE;
+      g_source_remove (state_changed_id);
+      state_changed_id = 0;
     }
 
-  sender = g_dbus_method_invocation_get_sender (invocation);
-
-  request = request_new (sender, arg_app_id, arg_handle);
-
-  g_signal_connect (request, "handle-close", G_CALLBACK (handle_close_fdo), NULL);
+  broadcast_valid = TRUE;
+  broadcast_screensaver_active = screensaver_active;
+  broadcast_session_state = session_state;
 
-  request_export (request, g_dbus_method_invocation_get_connection (invocation));
-
-  if (!g_variant_lookup (arg_options, "reason", "&s", &reason))
-    reason = "";
-
-  org_freedesktop_screen_saver_call_inhibit (fdo_screensaver,
-                                             arg_app_id,
-                                             reason,
-                                             NULL,
-                                             inhibit_done_fdo,
-                                             g_object_ref (request));
-
-  xdp_impl_inhibit_complete_inhibit (object, invocation);
+  if (active_sessions == NULL)
+    return;
 
-  return TRUE;
+  g_hash_table_iter_init (&iter, active_sessions);
+  while (g_hash_table_iter_next (&iter, NULL, (gpointer *)&session))
+    emit_state_changed (session);
 }
 
-static GList *active_sessions = NULL;
-
-static void
-emit_state_changed (Session *session)
+static gboolean
+state_changed_timeout (gpointer data)
 {
-  GVariantBuilder state;
+  state_changed_id = 0;
 
-  g_debug ("Emitting StateChanged for session %s", session->id);
+  /* Flapped back to what was sent last */
+  if (broadcast_valid &&
+      broadcast_screensaver_active == screensaver_active &&
+      broadcast_session_state == session_state)
+    return G_SOURCE_REMOVE;
 
-  g_variant_builder_init (&state, G_VARIANT_TYPE_VARDICT);
-  g_variant_builder_add (&state, "{sv}", "screensaver-active", g_variant_new_boolean (screensaver_active));
-  g_variant_builder_add (&state, "{sv}", "session-state", g_variant_new_uint32 (session_state));
-  g_signal_emit_by_name (inhibit, "state-changed", session->id, g_variant_builder_end (&state)); 
+  global_emit_state_changed ();
+
+  return G_SOURCE_REMOVE;
 }
 
 static void
-global_emit_state_changed (void)
+schedule_state_changed (void)
 {
-  GList *l;
-
-  for (l = active_sessions; l; l = l->next)
-    emit_state_changed ((Session *)l->data);
+  if (state_changed_id == 0)
+    state_changed_id = g_timeout_add (STATE_CHANGED_DELAY, state_changed_timeout, NULL);
 }
 
 typedef struct
 {
   Session parent;
-  gboolean pending_query_end_response;
+  guint query_end_serial;
 } InhibitSession;
 
 typedef struct _InhibitSessionClass
@@ -413,31 +732,43 @@ typedef struct _InhibitSessionClass
 GType inhibit_session_get_type (void);
 G_DEFINE_TYPE (InhibitSession, inhibit_session, session_get_type ())
 
+/* Each QueryEndSession gets a new serial. A session has answered it
+ * when its query_end_serial matches, so starting a round does not have
+ * to touch every session, and a counter tracks who is left.
+ */
+static guint query_end_serial;
+static gboolean query_end_active;
+static guint n_pending_query_end_responses;
+
 static void
-global_set_pending_query_end_response (gboolean pending)
+global_start_query_end (void)
 {
-  GList *l;
+  query_end_serial++;
+  query_end_active = TRUE;
+  n_pending_query_end_responses = active_sessions ? g_hash_table_size (active_sessions) : 0;
+}
 
-  for (l = active_sessions; l; l = l->next)
-    {
-      InhibitSession *session = (InhibitSession *)l->data;
-      session->pending_query_end_response = pending;
-    }
+static void
+global_stop_query_end (void)
+{
+  query_end_active = FALSE;
+  n_pending_query_end_responses = 0;
 }
 
 static gboolean
 global_get_pending_query_end_response (void)
 {
-  GList *l;
+  return n_pending_query_end_responses > 0;
+}
 
-  for (l = active_sessions; l; l = l->next)
-    {
-      InhibitSession *session = (InhibitSession *)l->data;
-      if (session->pending_query_end_response)
-        return TRUE;
-    }
+static void
+inhibit_session_answer_query_end (InhibitSession *session)
+{
+  if (!query_end_active || session->query_end_serial == query_end_serial)
+    return;
 
-  return FALSE;
+  session->query_end_serial = query_end_serial;
+  n_pending_query_end_responses--;
 }
 
 static void
@@ -447,12 +778,24 @@ inhibit_session_close (Session *session)
 
   g_debug ("Closing inhibit session %s", ((Session *)inhibit_session)->id);
 
-  active_sessions = g_list_remove (active_sessions, session);
+  /* A closed session won't answer */
+  inhibit_session_answer_query_end (inhibit_session);
+
+  g_hash_table_remove (active_sessions, session->id);
 }
 
 static void
 inhibit_session_finalize (GObject *object)
 {
+  Session *session = (Session *)object;
+
+  /* Not closed if it failed to export */
+  if (active_sessions && g_hash_table_lookup (active_sessions, session->id) == session)
+    {
+      inhibit_session_answer_query_end ((InhibitSession *)session);
+      g_hash_table_remove (active_sessions, session->id);
+    }
+
   G_OBJECT_CLASS (inhibit_session_parent_class)->finalize (object);
 }
 
@@ -486,7 +829,12 @@ inhibit_session_new (const char *app_id,
                                   "id", session_handle,
                                   NULL);
 
-  active_sessions = g_list_prepend (active_sessions, inhibit_session);
+  /* Sessions created during a QueryEndSession round are not waited for */
+  inhibit_session->query_end_serial = query_end_serial;
+
+  if (active_sessions == NULL)
+    active_sessions = g_hash_table_new (g_str_hash, g_str_equal);
+  g_hash_table_insert (active_sessions, ((Session *)inhibit_session)->id, inhibit_session);
 
   return inhibit_session;
 }
@@ -534,7 +882,7 @@ handle_query_end_response (XdpImplInhibit *object,
 
   if (session)
     {
-      session->pending_query_end_response = FALSE;
+      inhibit_session_answer_query_end (session);
       maybe_send_quit_response ();
     }
  
@@ -551,7 +899,7 @@ global_active_changed_cb (GObject *object,
 
   screensaver_active = active;
 
-  global_emit_state_changed ();
+  schedule_state_changed ();
 }
 
 gboolean
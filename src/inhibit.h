@@ -23,3 +23,4 @@
 #include <gio/gio.h>
 
 gboolean inhibit_init (GDBusConnection *bus, GError **error);
+void inhibit_dump_state (void);
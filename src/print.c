@@ -22,15 +22,28 @@
 
 #include "config.h"
 
+#include <errno.h>
+#include <fcntl.h>
 #include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#ifdef HAVE_MEMFD_CREATE
+#include <sys/mman.h>
+#endif
+#ifdef HAVE_SENDFILE
+#include <sys/sendfile.h>
+#endif
+#ifdef HAVE_LINUX_FS_H
+#include <linux/fs.h>
+#endif
 
 #include <gtk/gtk.h>
 #include <gtk/gtkunixprint.h>
 
 #include <gio/gio.h>
 #include <gio/gunixfdlist.h>
-#include <gio/gunixinputstream.h>
-#include <gio/gunixoutputstream.h>
 #include <gio/gdesktopappinfo.h>
 
 #include "xdg-desktop-portal-dbus.h"
@@ -152,6 +165,8 @@ typedef struct {
 
   PrintParams *params;
 
+  GCancellable *cancellable;
+
 } PrintDialogHandle;
 
 static void
@@ -159,10 +174,15 @@ print_dialog_handle_free (gpointer data)
 {
   PrintDialogHandle *handle = data;
 
+  if (handle->cancellable)
+    g_cancellable_cancel (handle->cancellable);
+  g_clear_object (&handle->cancellable);
+
   g_clear_object (&handle->external_parent);
   g_object_unref (handle->request);
-  g_object_unref (handle->dialog);
-  close (handle->fd);
+  g_clear_object (&handle->dialog);
+  if (handle->fd != -1)
+    close (handle->fd);
 
   g_free (handle);
 }
@@ -170,23 +190,153 @@ print_dialog_handle_free (gpointer data)
 static void
 print_dialog_handle_close (PrintDialogHandle *handle)
 {
-  gtk_widget_destroy (handle->dialog);
+  if (handle->dialog)
+    gtk_widget_destroy (handle->dialog);
   print_dialog_handle_free (handle);
 }
 
-static gboolean
-can_preview (void)
+/* -1 until evince-previewer has been looked for. The lookup is a PATH
+ * scan, so it is only repeated when the portal is idle.
+ */
+static int preview_available = -1;
+
+static void
+update_can_preview (void)
 {
   g_autofree char *path = NULL;
 
   path = g_find_program_in_path ("evince-previewer");
 
-  if (path)
-    return TRUE;
+  if (path == NULL && preview_available != FALSE)
+    g_warning ("evince-previewer not found, disabling print preview");
 
-  g_warning ("evince-previewer not found, disabling print preview");
+  preview_available = path != NULL;
+}
 
-  return FALSE;
+static gboolean
+can_preview (void)
+{
+  if (preview_available == -1)
+    update_can_preview ();
+
+  return preview_available;
+}
+
+/* Creating a GtkPrintUnixDialog loads the print backends and starts
+ * enumerating printers, which can take seconds when there are many
+ * network printers. Keep one hidden dialog per display that was built
+ * while the portal was idle; its backends keep the printer list current
+ * as printers come and go, so a request gets a populated list right
+ * away. As with the file chooser pool, a dialog is never reused once it
+ * has been shown.
+ */
+static GHashTable *warm_dialogs;
+static guint warm_id;
+
+static GtkWidget *
+warm_dialog_new (GdkDisplay *display)
+{
+  GtkWidget *fake_parent;
+  GtkWidget *dialog;
+
+  fake_parent = g_object_new (GTK_TYPE_WINDOW,
+                              "type", GTK_WINDOW_TOPLEVEL,
+                              "screen", gdk_display_get_default_screen (display),
+                              NULL);
+  g_object_ref_sink (fake_parent);
+
+  dialog = gtk_print_unix_dialog_new (NULL, GTK_WINDOW (fake_parent));
+  g_object_set_data_full (G_OBJECT (dialog), "fake-parent", fake_parent, g_object_unref);
+
+  return g_object_ref (dialog);
+}
+
+static void
+warm_dialog_free (gpointer data)
+{
+  GtkWidget *dialog = data;
+
+  if (dialog == NULL)
+    return;
+
+  gtk_widget_destroy (dialog);
+  g_object_unref (dialog);
+}
+
+static void
+display_closed (GdkDisplay *display,
+                gboolean is_error,
+                gpointer data)
+{
+  g_hash_table_remove (warm_dialogs, display);
+}
+
+/* Builds one dialog per iteration, to keep each one short */
+static gboolean
+warm_up_dialogs (gpointer data)
+{
+  GHashTableIter iter;
+  GdkDisplay *display;
+  GtkWidget *dialog;
+
+  g_hash_table_iter_init (&iter, warm_dialogs);
+  while (g_hash_table_iter_next (&iter, (gpointer *)&display, (gpointer *)&dialog))
+    {
+      if (dialog == NULL)
+        {
+          g_hash_table_iter_replace (&iter, warm_dialog_new (display));
+          return G_SOURCE_CONTINUE;
+        }
+    }
+
+  update_can_preview ();
+
+  warm_id = 0;
+  return G_SOURCE_REMOVE;
+}
+
+static void
+schedule_warm_up (GdkDisplay *display)
+{
+  if (warm_dialogs == NULL)
+    warm_dialogs = g_hash_table_new_full (NULL, NULL, NULL, warm_dialog_free);
+
+  /* A display stays in the table, with a NULL dialog while one is
+   * being built, until it is closed, so this connects once per display.
+   */
+  if (!g_hash_table_contains (warm_dialogs, display))
+    {
+      g_signal_connect (display, "closed", G_CALLBACK (display_closed), NULL);
+      g_hash_table_insert (warm_dialogs, display, NULL);
+    }
+
+  if (warm_id == 0)
+    warm_id = g_idle_add_full (G_PRIORITY_LOW, warm_up_dialogs, NULL, NULL);
+}
+
+/* Returns a new reference */
+static GtkWidget *
+take_warm_dialog (GdkDisplay *display)
+{
+  GtkWidget *dialog = NULL;
+
+  if (warm_dialogs)
+    {
+      dialog = g_hash_table_lookup (warm_dialogs, display);
+      if (dialog)
+        {
+          /* Keep the key, just hand out the value */
+          g_hash_table_steal (warm_dialogs, display);
+          g_hash_table_insert (warm_dialogs, display, NULL);
+        }
+    }
+
+  if (dialog == NULL)
+    dialog = warm_dialog_new (display);
+
+  schedule_warm_up (display);
+
+  return dialog;
 }
 
 static GtkPrintCapabilities
@@ -285,6 +435,574 @@ out:
   return retval;
 }
 
+#define COPY_CHUNK_SIZE (8 * 1024 * 1024)
+#define COPY_BUFFER_SIZE (256 * 1024)
+#define MAX_MEMFD_SPOOL_SIZE (16 * 1024 * 1024)
+
+static gboolean
+write_all (int fd,
+           const char *buffer,
+           gssize size)
+{
+  while (size > 0)
+    {
+      gssize written;
+
+      written = write (fd, buffer, size);
+      if (written == -1)
+        {
+          if (errno == EINTR)
+            continue;
+          return FALSE;
+        }
+
+      buffer += written;
+      size -= written;
+    }
+
+  return TRUE;
+}
+
+/* Copies everything from the current position of in_fd to out_fd,
+ * preferring a reflink, then copies done inside the kernel, and only
+ * falling back to read()/write() for pipes and friends.
+ */
+static gboolean
+copy_document (int in_fd,
+               int out_fd,
+               GCancellable *cancellable,
+               GError **error)
+{
+  enum {
+    COPY_FILE_RANGE,
+    SENDFILE,
+    READ_WRITE
+  } method = COPY_FILE_RANGE;
+  g_autofree char *buffer = NULL;
+
+#ifdef FICLONE
+  if (lseek (in_fd, 0, SEEK_CUR) == 0 &&
+      ioctl (out_fd, FICLONE, in_fd) == 0)
+    return TRUE;
+#endif
+
+  while (TRUE)
+    {
+      gssize n = -1;
+
+      if (g_cancellable_set_error_if_cancelled (cancellable, error))
+        return FALSE;
+
+      switch (method)
+        {
+        case COPY_FILE_RANGE:
+#ifdef HAVE_COPY_FILE_RANGE
+          n = copy_file_range (in_fd, NULL, out_fd, NULL, COPY_CHUNK_SIZE, 0);
+          if (n == -1 &&
+              (errno == EXDEV || errno == EINVAL || errno == ENOSYS ||
+               errno == EOPNOTSUPP || errno == EBADF))
+#endif
+            {
+              method = SENDFILE;
+              continue;
+            }
+          break;
+
+        case SENDFILE:
+#ifdef HAVE_SENDFILE
+          n = sendfile (out_fd, in_fd, NULL, COPY_CHUNK_SIZE);
+          if (n == -1 && (errno == EINVAL || errno == ENOSYS))
+#endif
+            {
+              method = READ_WRITE;
+              continue;
+            }
+          break;
+
+        case READ_WRITE:
+          if (buffer == NULL)
+            buffer = g_malloc (COPY_BUFFER_SIZE);
+
+          n = read (in_fd, buffer, COPY_BUFFER_SIZE);
+          if (n > 0 && !write_all (out_fd, buffer, n))
+            n = -1;
+          break;
+
+        default:
+          g_assert_not_reached ();
+        }
+
+      if (n == 0)
+        return TRUE;
+
+      if (n == -1)
+        {
+          int errsv = errno;
+
+          if (errsv == EINTR)
+            continue;
+
+          g_set_error (error, G_IO_ERROR, g_io_error_from_errno (errsv),
+                       "Failed to copy document: %s", g_strerror (errsv));
+          return FALSE;
+        }
+    }
+}
+
+/* A seekable regular file (memfds included) can be handed to the print
+ * job as it is. We reopen it, so the job gets a read-only file
+ * description with its own offset instead of sharing the app's.
+ * Reopening must not grant more than the app has, so a write-only fd
+ * goes through the copy, where reading it fails.
+ */
+static int
+reopen_document (int fd)
+{
+  struct stat st;
+  g_autofree char *path = NULL;
+  int flags;
+
+  flags = fcntl (fd, F_GETFL);
+  if (flags == -1 ||
+      ((flags & O_ACCMODE) != O_RDONLY && (flags & O_ACCMODE) != O_RDWR))
+    return -1;
+
+  if (fstat (fd, &st) != 0 || !S_ISREG (st.st_mode))
+    return -1;
+
+  if (lseek (fd, 0, SEEK_CUR) == -1)
+    return -1;
+
+  path = g_strdup_printf ("/proc/self/fd/%d", fd);
+
+  return open (path, O_RDONLY | O_CLOEXEC);
+}
+
+/* The spool for a print job never needs a name, so keep small ones in
+ * memory when we can. Large documents, and those of unknown size, are
+ * spooled to disk rather than to RAM or swap.
+ */
+static gboolean
+spool_in_memory (goffset size)
+{
+#ifdef HAVE_MEMFD_CREATE
+  return size > 0 && size <= MAX_MEMFD_SPOOL_SIZE;
+#else
+  return FALSE;
+#endif
+}
+
+static int
+open_spool_file (goffset size,
+                 GError **error)
+{
+  g_autofree char *filename = NULL;
+  int fd;
+
+#ifdef HAVE_MEMFD_CREATE
+  if (spool_in_memory (size))
+    {
+      fd = memfd_create (PACKAGE_NAME "-spool", MFD_CLOEXEC);
+      if (fd != -1)
+        return fd;
+    }
+#endif
+
+  fd = g_file_open_tmp (PACKAGE_NAME "XXXXXX", &filename, error);
+  if (fd != -1)
+    unlink (filename);
+
+  return fd;
+}
+
+/* The previewer wants a file name, prefer the runtime dir (usually a
+ * tmpfs) over /tmp.
+ */
+static int
+open_preview_file (char **filename,
+                   GError **error)
+{
+  g_autofree char *path = NULL;
+  int fd;
+
+  path = g_build_filename (g_get_user_runtime_dir (), PACKAGE_NAME "XXXXXX", NULL);
+  fd = g_mkstemp (path);
+  if (fd != -1)
+    {
+      *filename = g_steal_pointer (&path);
+      return fd;
+    }
+
+  return g_file_open_tmp (PACKAGE_NAME "XXXXXX", filename, error);
+}
+
+/* Print jobs go through a queue: at most max_print_jobs are being
+ * spooled or printed at a time, and a job that has to be copied only
+ * starts once there is room for the copy in the spool location. A job
+ * stays active until the print backend is done with its spool, or until
+ * the previewer has been launched.
+ */
+#define DEFAULT_MAX_PRINT_JOBS 4
+
+static guint max_print_jobs = DEFAULT_MAX_PRINT_JOBS;
+static GQueue pending_jobs = G_QUEUE_INIT;
+static guint n_active_jobs;
+static goffset reserved_spool_size;
+static guint64 n_completed_jobs;
+static guint64 n_failed_jobs;
+
+typedef struct {
+  char *title;
+  char *filename;
+  int fd;
+  int spool_fd;
+  goffset size;
+  goffset reserved;
+  gboolean zero_copy;
+  gboolean active;
+  gboolean failed;
+  gboolean preview;
+  GtkPrintJob *job;
+  GtkPrintSettings *settings;
+  GtkPageSetup *page_setup;
+} PrintFile;
+
+typedef struct {
+  char *title;
+  int fd;
+  gboolean failed;
+} PrintSpool;
+
+static void start_pending_jobs (void);
+
+static void
+release_job_slot (const char *title,
+                  gboolean failed)
+{
+  g_assert (n_active_jobs > 0);
+
+  n_active_jobs--;
+  if (failed)
+    n_failed_jobs++;
+  else
+    n_completed_jobs++;
+
+  g_debug ("Print job '%s' %s, %u active, %u queued",
+           title, failed ? "failed" : "done",
+           n_active_jobs, pending_jobs.length);
+
+  start_pending_jobs ();
+}
+
+static void
+release_spool_reservation (PrintFile *file)
+{
+  reserved_spool_size -= file->reserved;
+  file->reserved = 0;
+}
+
+/* Free space where open_spool_file() or open_preview_file() will put
+ * the copy. memfds are shmem, which /dev/shm gives a fair idea of.
+ */
+static goffset
+spool_space_available (PrintFile *file)
+{
+  struct statvfs buf;
+  const char *dir;
+
+  if (file->preview)
+    dir = g_get_user_runtime_dir ();
+  else if (spool_in_memory (file->size))
+    dir = "/dev/shm";
+  else
+    dir = g_get_tmp_dir ();
+
+  if (statvfs (dir, &buf) != 0)
+    return G_MAXINT64;
+
+  return (goffset) buf.f_bavail * buf.f_frsize;
+}
+
+/* Returns FALSE if the job has to wait, and sets error if it would
+ * never fit.
+ */
+static gboolean
+admit_print_file (PrintFile *file,
+                  GError **error)
+{
+  if (max_print_jobs > 0 && n_active_jobs >= max_print_jobs)
+    return FALSE;
+
+  if (file->size > spool_space_available (file) - reserved_spool_size)
+    {
+      if (n_active_jobs == 0)
+        g_set_error (error, G_IO_ERROR, G_IO_ERROR_NO_SPACE,
+                     "Not enough space to spool the document");
+      return FALSE;
+    }
+
+  file->active = TRUE;
+  file->reserved = file->size;
+  reserved_spool_size += file->reserved;
+  n_active_jobs++;
+
+  return TRUE;
+}
+
+static void
+print_job_status_changed (GtkPrintJob *job,
+                          gpointer data)
+{
+  GEnumClass *class;
+  GEnumValue *value;
+
+  class = g_type_class_ref (GTK_TYPE_PRINT_STATUS);
+  value = g_enum_get_value (class, gtk_print_job_get_status (job));
+  g_debug ("Print job '%s': %s", gtk_print_job_get_title (job),
+           value ? value->value_nick : "unknown");
+  g_type_class_unref (class);
+}
+
+static void
+print_job_complete (GtkPrintJob *job,
+                    gpointer data,
+                    const GError *error)
+{
+  PrintSpool *spool = data;
+
+  if (error)
+    {
+      g_warning ("Print job failed: %s", error->message);
+      spool->failed = TRUE;
+    }
+}
+
+static void
+print_spool_free (gpointer data)
+{
+  PrintSpool *spool = data;
+
+  close (spool->fd);
+  release_job_slot (spool->title, spool->failed);
+
+  g_free (spool->title);
+  g_free (spool);
+}
+
+/* Takes ownership of fd on success, it is closed once the print
+ * backend is done with it. The job slot goes with it.
+ */
+static gboolean
+queue_print_job (PrintFile *file,
+                 int fd,
+                 GError **error)
+{
+  PrintSpool *spool;
+
+  if (!gtk_print_job_set_source_fd (file->job, fd, error))
+    return FALSE;
+
+  spool = g_new0 (PrintSpool, 1);
+  spool->title = g_strdup (file->title);
+  spool->fd = fd;
+  file->active = FALSE;
+
+  gtk_print_job_send (file->job, print_job_complete, spool, print_spool_free);
+
+  return TRUE;
+}
+
+static void
+print_file_free (gpointer data)
+{
+  PrintFile *file = data;
+
+  /* Still set if the document never made it to the previewer */
+  if (file->filename)
+    unlink (file->filename);
+
+  if (file->fd != -1)
+    close (file->fd);
+  if (file->spool_fd != -1)
+    close (file->spool_fd);
+
+  release_spool_reservation (file);
+  if (file->active)
+    release_job_slot (file->title, file->failed);
+
+  g_free (file->title);
+  g_free (file->filename);
+  g_clear_object (&file->job);
+  g_clear_object (&file->settings);
+  g_clear_object (&file->page_setup);
+
+  g_free (file);
+}
+
+static void
+copy_document_thread (GTask *task,
+                      gpointer source_object,
+                      gpointer task_data,
+                      GCancellable *cancellable)
+{
+  PrintFile *file = task_data;
+  GError *error = NULL;
+
+  if (!copy_document (file->fd, file->spool_fd, cancellable, &error))
+    g_task_return_error (task, error);
+  else
+    g_task_return_boolean (task, TRUE);
+}
+
+static void
+print_file_copied (GObject *source,
+                   GAsyncResult *result,
+                   gpointer data)
+{
+  g_autoptr(GTask) task = data;
+  PrintFile *file = g_task_get_task_data (task);
+  GError *error = NULL;
+
+  /* From here on the copy shows up in the free space */
+  release_spool_reservation (file);
+
+  if (!g_task_propagate_boolean (G_TASK (result), &error))
+    {
+      g_task_return_error (task, error);
+      return;
+    }
+
+  if (g_task_return_error_if_cancelled (task))
+    return;
+
+  close (file->fd);
+  file->fd = -1;
+
+  if (file->job)
+    {
+      if (!queue_print_job (file, file->spool_fd, &error))
+        {
+          g_task_return_error (task, error);
+          return;
+        }
+      file->spool_fd = -1;
+    }
+  else
+    {
+      close (file->spool_fd);
+      file->spool_fd = -1;
+
+      if (!launch_preview (file->filename, file->title, file->settings, file->page_setup, &error))
+        {
+          g_task_return_error (task, error);
+          return;
+        }
+
+      /* evince-previewer removes the file when it is done with it */
+      g_clear_pointer (&file->filename, g_free);
+      file->failed = FALSE;
+    }
+
+  g_task_return_boolean (task, TRUE);
+}
+
+static void
+start_print_file (GTask *task)
+{
+  PrintFile *file = g_task_get_task_data (task);
+  g_autoptr(GTask) copy_task = NULL;
+  GError *error = NULL;
+
+  if (file->zero_copy)
+    {
+      if (!queue_print_job (file, file->fd, &error))
+        {
+          g_task_return_error (task, error);
+          return;
+        }
+      file->fd = -1;
+
+      g_task_return_boolean (task, TRUE);
+      return;
+    }
+
+  if (file->job)
+    file->spool_fd = open_spool_file (file->size, &error);
+  else
+    file->spool_fd = open_preview_file (&file->filename, &error);
+
+  if (file->spool_fd == -1)
+    {
+      g_task_return_error (task, error);
+      return;
+    }
+
+  g_debug ("Copying document for print job '%s'", file->title);
+
+  copy_task = g_task_new (NULL, g_task_get_cancellable (task), print_file_copied, g_object_ref (task));
+  g_task_set_source_tag (copy_task, copy_document);
+  g_task_set_task_data (copy_task, file, NULL);
+  g_task_run_in_thread (copy_task, copy_document_thread);
+}
+
+static void
+queue_pending_job (GTask *task)
+{
+  PrintFile *file = g_task_get_task_data (task);
+
+  g_debug ("Queueing print job '%s', %u active, %u queued",
+           file->title, n_active_jobs, pending_jobs.length);
+
+  g_queue_push_tail (&pending_jobs, task);
+}
+
+static void
+start_pending_jobs (void)
+{
+  GTask *task;
+
+  while ((task = g_queue_peek_head (&pending_jobs)) != NULL)
+    {
+      PrintFile *file = g_task_get_task_data (task);
+      GError *error = NULL;
+
+      if (!admit_print_file (file, &error) && error == NULL)
+        break;
+
+      g_queue_pop_head (&pending_jobs);
+
+      if (error)
+        g_task_return_error (task, error);
+      else
+        start_print_file (task);
+
+      g_object_unref (task);
+    }
+}
+
+static void
+queued_print_file_done (GObject *source,
+                        GAsyncResult *result,
+                        gpointer data)
+{
+  g_autoptr(GError) error = NULL;
+
+  if (!g_task_propagate_boolean (G_TASK (result), &error))
+    g_warning ("Failed to print queued document: %s", error->message);
+}
+
+/* Takes ownership of fd. Where possible the document is handed to the
+ * print job without copying it; otherwise it is copied in a thread, so
+ * that a large document does not block the other portals while it is
+ * read.
+ *
+ * A job that can start right away invokes the callback once it has been
+ * handed to the print backend (or the previewer), so that failures can
+ * still be reported. A job that has to wait for a slot is detached from
+ * the caller instead: print_file() returns TRUE, the callback is never
+ * invoked, the cancellable is ignored, and later failures are only
+ * logged. That way a busy queue doesn't hold the Print call open.
+ */
 static gboolean
 print_file (int fd,
             const char *app_id,
@@ -292,18 +1010,26 @@ print_file (int fd,
             GtkPrinter *printer,
             GtkPrintSettings *settings,
             GtkPageSetup *page_setup,
-            GError **error)
+            GCancellable *cancellable,
+            GAsyncReadyCallback callback,
+            gpointer data)
 {
-  g_autoptr (GtkPrintJob) job = NULL;
-  g_autofree char *title = NULL;
-  g_autofree char *filename = NULL;
-  g_autoptr(GUnixInputStream) istream = NULL;
-  g_autoptr(GUnixOutputStream) ostream = NULL;
-  int fd2;
+  g_autoptr(GTask) task = NULL;
+  PrintFile *file;
   g_autofree char *app_desktop_fullname = NULL;
   g_autoptr (GDesktopAppInfo) app_info = NULL;
   // ensures the app_name won't be NULL even if the app_id.desktop file doesn't exist
   g_autofree char *app_name = NULL;
+  struct stat st;
+  GError *error = NULL;
+
+  file = g_new0 (PrintFile, 1);
+  file->fd = fd;
+  file->spool_fd = -1;
+  file->failed = TRUE;
+  file->preview = preview;
+  file->settings = g_object_ref (settings);
+  file->page_setup = g_object_ref (page_setup);
 
   if (!g_str_has_suffix (app_id, ".desktop"))
     {
@@ -323,52 +1049,100 @@ print_file (int fd,
   if (app_name == NULL)
     app_name = g_strdup (app_id);
 
-  title = g_strdup_printf ("Document from %s", app_name);
+  file->title = g_strdup_printf ("Document from %s", app_name);
 
   if (!preview)
-    job = gtk_print_job_new (title, printer, settings, page_setup);
-
-#if GTK_CHECK_VERSION (3, 22, 0)
-  if (job && !gtk_print_job_set_source_fd (job, fd, error))
-    return FALSE;
-#endif
+    {
+      int source_fd;
 
-  istream = (GUnixInputStream *)g_unix_input_stream_new (fd, FALSE);
+      file->job = gtk_print_job_new (file->title, printer, settings, page_setup);
+      g_signal_connect (file->job, "status-changed", G_CALLBACK (print_job_status_changed), NULL);
 
-  if ((fd2 = g_file_open_tmp (PACKAGE_NAME "XXXXXX", &filename, error)) == -1)
-    return FALSE;
+      source_fd = reopen_document (fd);
+      if (source_fd != -1)
+        {
+          close (file->fd);
+          file->fd = source_fd;
+          file->zero_copy = TRUE;
+        }
+    }
 
-  ostream = (GUnixOutputStream *)g_unix_output_stream_new (fd2, TRUE);
+  /* Reserve room for the copy, if we know how large it is */
+  if (!file->zero_copy && fstat (file->fd, &st) == 0 && S_ISREG (st.st_mode))
+    file->size = st.st_size;
 
-  if (g_output_stream_splice (G_OUTPUT_STREAM (ostream),
-                              G_INPUT_STREAM (istream),
-                              G_OUTPUT_STREAM_SPLICE_NONE,
-                              NULL,
-                              error) == -1)
-    return FALSE;
-  if (job)
+  if (pending_jobs.length == 0 && admit_print_file (file, &error))
     {
-      if (!gtk_print_job_set_source_file (job, filename, error))
-        return FALSE;
-
-      gtk_print_job_send (job, NULL, NULL, NULL);
+      task = g_task_new (NULL, cancellable, callback, data);
+      g_task_set_source_tag (task, print_file);
+      g_task_set_task_data (task, file, print_file_free);
+      start_print_file (task);
+    }
+  else if (error)
+    {
+      task = g_task_new (NULL, cancellable, callback, data);
+      g_task_set_source_tag (task, print_file);
+      g_task_set_task_data (task, file, print_file_free);
+      g_task_return_error (task, error);
     }
   else
     {
-      if (!launch_preview (filename, title, settings, page_setup, error))
-	{
-	  unlink (filename);
-	  return FALSE;
-	}
+      task = g_task_new (NULL, NULL, queued_print_file_done, NULL);
+      g_task_set_source_tag (task, print_file);
+      g_task_set_task_data (task, file, print_file_free);
+      queue_pending_job (g_steal_pointer (&task));
+      return TRUE;
     }
 
-  /* The file will be removed when the GtkPrintJob closes it (once the job is
-   * complete).
-   */
-  if (!preview)
-    unlink (filename);
+  return FALSE;
+}
 
-  return TRUE;
+static gboolean
+print_file_finish (GAsyncResult *result,
+                   GError **error)
+{
+  return g_task_propagate_boolean (G_TASK (result), error);
+}
+
+static void
+send_print_response (PrintDialogHandle *handle)
+{
+  GVariantBuilder opt_builder;
+
+  if (handle->request->exported)
+    request_unexport (handle->request);
+
+  g_variant_builder_init (&opt_builder, G_VARIANT_TYPE_VARDICT);
+  xdp_impl_print_complete_print (handle->impl,
+                                 handle->invocation,
+                                 NULL,
+                                 handle->response,
+                                 g_variant_builder_end (&opt_builder));
+
+  print_dialog_handle_close (handle);
+}
+
+static void
+print_file_done (GObject *source,
+                 GAsyncResult *result,
+                 gpointer data)
+{
+  PrintDialogHandle *handle = data;
+  g_autoptr(GError) error = NULL;
+
+  if (!print_file_finish (result, &error))
+    {
+      /* The request was closed, and the handle is gone */
+      if (g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+        return;
+
+      g_warning ("Failed to print document: %s", error->message);
+      handle->response = 2;
+    }
+  else
+    handle->response = 0;
+
+  send_print_response (handle);
 }
 
 static void
@@ -377,8 +1151,8 @@ handle_print_response (GtkDialog *dialog,
                        gpointer data)
 {
   PrintDialogHandle *handle = data;
-  g_autoptr(GError) error = NULL;
   gboolean preview = FALSE;
+  gboolean queued;
 
   switch (response)
     {
@@ -399,49 +1173,38 @@ handle_print_response (GtkDialog *dialog,
     case GTK_RESPONSE_OK:
       {
         GtkPrinter *printer;
-        GtkPrintSettings *settings;
+        g_autoptr(GtkPrintSettings) settings = NULL;
         GtkPageSetup *page_setup;
 
         printer = gtk_print_unix_dialog_get_selected_printer (GTK_PRINT_UNIX_DIALOG (handle->dialog));
         settings = gtk_print_unix_dialog_get_settings (GTK_PRINT_UNIX_DIALOG (handle->dialog));
         page_setup = gtk_print_unix_dialog_get_page_setup (GTK_PRINT_UNIX_DIALOG (handle->dialog));
 
-        if (!print_file (handle->fd,
-                         handle->request->app_id,
-                         preview,
-                         printer,
-                         settings,
-                         page_setup,
-                         &error))
-          handle->response = 2;
-        else
-          handle->response = 0;
+        /* The request stays exported until the document has been
+         * handed off, so it can still be closed while it is being read.
+         */
+        gtk_widget_hide (handle->dialog);
+
+        handle->cancellable = g_cancellable_new ();
+        queued = print_file (handle->fd,
+                             handle->request->app_id,
+                             preview,
+                             printer,
+                             settings,
+                             page_setup,
+                             handle->cancellable,
+                             print_file_done,
+                             handle);
+        handle->fd = -1;
+        if (!queued)
+          return;
 
-        g_object_unref (settings);
+        handle->response = 0;
       }
       break;
     }
 
-  if (handle->request->exported)
-    request_unexport (handle->request);
-
-  if (error)
-    {
-      g_dbus_method_invocation_take_error (handle->invocation, error);
-    }
-  else
-    {
-      GVariantBuilder opt_builder;
-
-      g_variant_builder_init (&opt_builder, G_VARIANT_TYPE_VARDICT);
-      xdp_impl_print_complete_print (handle->impl,
-                                     handle->invocation,
-                                     NULL,
-                                     handle->response,
-                                     g_variant_builder_end (&opt_builder));
-    }
-
-  print_dialog_handle_close (handle);
+  send_print_response (handle);
 }
 
 static gboolean
@@ -488,9 +1251,7 @@ handle_print (XdpImplPrint *object,
   int idx, fd;
   gboolean modal;
   GdkDisplay *display;
-  GdkScreen *screen;
   ExternalWindow *external_parent = NULL;
-  GtkWidget *fake_parent;
 
   g_variant_get (arg_fd_in, "h", &idx);
   fd = g_unix_fd_list_get (fd_list, idx, NULL);
@@ -499,24 +1260,36 @@ handle_print (XdpImplPrint *object,
   params = get_print_params (arg_app_id, token);
   if (params)
     {
-      GVariantBuilder opt_builder;
-
-      print_file (fd,
-                  params->app_id,
-		  params->preview,
-                  params->printer,
-                  params->settings,
-                  params->page_setup,
-                  NULL);
+      sender = g_dbus_method_invocation_get_sender (invocation);
+      request = request_new (sender, arg_app_id, arg_handle);
+
+      handle = g_new0 (PrintDialogHandle, 1);
+      handle->impl = object;
+      handle->invocation = invocation;
+      handle->request = g_object_ref (request);
+      handle->fd = -1;
+      handle->cancellable = g_cancellable_new ();
+
+      g_signal_connect (request, "handle-close", G_CALLBACK (handle_close), handle);
+
+      request_export (request, g_dbus_method_invocation_get_connection (invocation));
+
+      if (print_file (fd,
+                      params->app_id,
+                      params->preview,
+                      params->printer,
+                      params->settings,
+                      params->page_setup,
+                      handle->cancellable,
+                      print_file_done,
+                      handle))
+        {
+          handle->response = 0;
+          send_print_response (handle);
+        }
 
       print_params_free (params);
 
-      g_variant_builder_init (&opt_builder, G_VARIANT_TYPE_VARDICT);
-      xdp_impl_print_complete_print (object,
-                                     invocation,
-                                     NULL,
-                                     0,
-                                     g_variant_builder_end (&opt_builder));
       return TRUE;
     }
 
@@ -535,19 +1308,13 @@ handle_print (XdpImplPrint *object,
     display = external_window_get_display (external_parent);
   else
     display = gdk_display_get_default ();
-  screen = gdk_display_get_default_screen (display);
 
-  fake_parent = g_object_new (GTK_TYPE_WINDOW,
-                              "type", GTK_WINDOW_TOPLEVEL,
-                              "screen", screen,
-                              NULL);
-  g_object_ref_sink (fake_parent);
+  dialog = take_warm_dialog (display);
 
   if (!g_variant_lookup (arg_options, "modal", "b", &modal))
     modal = TRUE;
 
-  dialog = gtk_print_unix_dialog_new (arg_title, NULL);
-  gtk_window_set_transient_for (GTK_WINDOW (dialog), GTK_WINDOW (fake_parent));
+  gtk_window_set_title (GTK_WINDOW (dialog), arg_title);
   gtk_window_set_modal (GTK_WINDOW (dialog), modal);
   gtk_print_unix_dialog_set_manual_capabilities (GTK_PRINT_UNIX_DIALOG (dialog),
                                                  print_capabilities_from_options (arg_options));
@@ -555,7 +1322,7 @@ handle_print (XdpImplPrint *object,
   handle->impl = object;
   handle->invocation = invocation;
   handle->request = g_object_ref (request);
-  handle->dialog = g_object_ref (dialog);
+  handle->dialog = dialog;
   handle->external_parent = external_parent;
   handle->fd = fd;
 
@@ -659,9 +1426,7 @@ handle_prepare_print (XdpImplPrint *object,
   GtkPageSetup *page_setup;
   gboolean modal;
   GdkDisplay *display;
-  GdkScreen *screen;
   ExternalWindow *external_parent = NULL;
-  GtkWidget *fake_parent;
 
   sender = g_dbus_method_invocation_get_sender (invocation);
 
@@ -679,21 +1444,15 @@ handle_prepare_print (XdpImplPrint *object,
     display = external_window_get_display (external_parent);
   else
     display = gdk_display_get_default ();
-  screen = gdk_display_get_default_screen (display);
 
-  fake_parent = g_object_new (GTK_TYPE_WINDOW,
-                              "type", GTK_WINDOW_TOPLEVEL,
-                              "screen", screen,
-                              NULL);
-  g_object_ref_sink (fake_parent);
+  dialog = take_warm_dialog (display);
 
   settings = gtk_print_settings_new_from_gvariant (arg_settings);
   page_setup = gtk_page_setup_new_from_gvariant (arg_page_setup);
   if (!g_variant_lookup (arg_options, "modal", "b", &modal))
     modal = TRUE;
 
-  dialog = gtk_print_unix_dialog_new (arg_title, NULL);
-  gtk_window_set_transient_for (GTK_WINDOW (dialog), GTK_WINDOW (fake_parent));
+  gtk_window_set_title (GTK_WINDOW (dialog), arg_title);
   gtk_window_set_modal (GTK_WINDOW (dialog), modal);
   gtk_print_unix_dialog_set_manual_capabilities (GTK_PRINT_UNIX_DIALOG (dialog),
                                                  print_capabilities_from_options (arg_options));
@@ -708,8 +1467,9 @@ handle_prepare_print (XdpImplPrint *object,
   handle->impl = object;
   handle->invocation = invocation;
   handle->request = g_object_ref (request);
-  handle->dialog = g_object_ref (dialog);
+  handle->dialog = dialog;
   handle->external_parent = external_parent;
+  handle->fd = -1;
 
   g_signal_connect (request, "handle-close", G_CALLBACK (handle_close), handle);
 
@@ -727,6 +1487,23 @@ handle_prepare_print (XdpImplPrint *object,
   return TRUE;
 }
 
+void
+print_set_max_jobs (guint max_jobs)
+{
+  max_print_jobs = max_jobs;
+  start_pending_jobs ();
+}
+
+void
+print_get_job_stats (PrintJobStats *stats)
+{
+  stats->n_queued = pending_jobs.length;
+  stats->n_active = n_active_jobs;
+  stats->n_completed = n_completed_jobs;
+  stats->n_failed = n_failed_jobs;
+  stats->reserved_spool_size = reserved_spool_size;
+}
+
 gboolean
 print_init (GDBusConnection *bus,
             GError **error)
@@ -746,5 +1523,7 @@ print_init (GDBusConnection *bus,
 
   g_debug ("providing %s", g_dbus_interface_skeleton_get_info (helper)->name);
 
+  schedule_warm_up (gdk_display_get_default ());
+
   return TRUE;
 }
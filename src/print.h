@@ -23,3 +23,16 @@
 #include <gio/gio.h>
 
 gboolean print_init (GDBusConnection *bus, GError **error);
+
+typedef struct
+{
+  guint n_queued;
+  guint n_active;
+  guint64 n_completed;
+  guint64 n_failed;
+  goffset reserved_spool_size;
+} PrintJobStats;
+
+/* 0 means no limit */
+void print_set_max_jobs (guint max_jobs);
+void print_get_job_stats (PrintJobStats *stats);
@@ -1,5 +1,24 @@
+#include <stdlib.h>
+#include <string.h>
+
 #include <gtk/gtk.h>
+#include <glib/gstdio.h>
 #include "appchooserdialog.h"
+#include "appinfoindex.h"
+
+/* With --benchmark, dialogs are built for synthetic choice lists against
+ * generated desktop files in a temporary XDG_DATA_DIRS, and the time
+ * spent in construction, in expanding the list and in merging an
+ * UpdateChoices call is printed. The dialogs are never mapped, so any
+ * GDK backend works, including broadway.
+ */
+
+#define APP_PREFIX "org.example.BenchApp"
+
+static gboolean opt_benchmark;
+static int opt_repeat = 5;
+
+static char *data_dir;
 
 static void
 close_cb (AppChooserDialog *dialog,
@@ -16,6 +35,235 @@ close_cb (AppChooserDialog *dialog,
         gtk_main_quit ();
 }
 
+static void
+write_desktop_files (guint n)
+{
+        g_autofree char *apps_dir = NULL;
+        guint i;
+
+        apps_dir = g_build_filename (data_dir, "applications", NULL);
+        g_mkdir_with_parents (apps_dir, 0700);
+
+        for (i = 0; i < n; i++) {
+                g_autofree char *name = NULL;
+                g_autofree char *path = NULL;
+                g_autofree char *contents = NULL;
+                g_autoptr(GError) error = NULL;
+
+                name = g_strdup_printf ("%s%u.desktop", APP_PREFIX, i);
+                path = g_build_filename (apps_dir, name, NULL);
+                contents = g_strdup_printf ("[Desktop Entry]\n"
+                                            "Type=Application\n"
+                                            "Name=Bench App %u\n"
+                                            "Exec=true %%f\n"
+                                            "Icon=application-x-executable\n"
+                                            "MimeType=text/plain;\n", i);
+
+                if (!g_file_set_contents (path, contents, -1, &error))
+                        g_error ("%s", error->message);
+        }
+}
+
+static void
+remove_recursively (const char *path)
+{
+        GDir *dir;
+
+        dir = g_dir_open (path, 0, NULL);
+        if (dir) {
+                const char *name;
+
+                while ((name = g_dir_read_name (dir)) != NULL) {
+                        g_autofree char *child = g_build_filename (path, name, NULL);
+                        remove_recursively (child);
+                }
+                g_dir_close (dir);
+        }
+
+        g_remove (path);
+}
+
+static char **
+make_choices (guint first,
+              guint n)
+{
+        char **choices;
+        guint i;
+
+        choices = g_new (char *, n + 1);
+        for (i = 0; i < n; i++)
+                choices[i] = g_strdup_printf ("%s%u", APP_PREFIX, first + i);
+        choices[n] = NULL;
+
+        return choices;
+}
+
+static void
+find_list_box (GtkWidget *widget,
+               gpointer   data)
+{
+        GtkWidget **list = data;
+
+        if (*list)
+                return;
+
+        if (GTK_IS_LIST_BOX (widget))
+                *list = widget;
+        else if (GTK_IS_CONTAINER (widget))
+                gtk_container_forall (GTK_CONTAINER (widget), find_list_box, list);
+}
+
+/* Runs the main loop until the list has a row at @index, and returns
+ * the longest single iteration, which is what the user would notice.
+ */
+static gint64
+wait_for_row (GtkListBox *list,
+              int         index)
+{
+        gint64 max_iteration = 0;
+
+        while (gtk_list_box_get_row_at_index (list, index) == NULL) {
+                gint64 start = g_get_monotonic_time ();
+
+                g_main_context_iteration (NULL, TRUE);
+                max_iteration = MAX (max_iteration, g_get_monotonic_time () - start);
+        }
+
+        return max_iteration;
+}
+
+static void
+flush_events (void)
+{
+        while (g_main_context_iteration (NULL, FALSE))
+                ;
+}
+
+typedef struct {
+        double construct;
+        double more;
+        double more_max;
+        double update;
+        double update_rows;
+} Sample;
+
+static int
+compare_double (gconstpointer a,
+                gconstpointer b)
+{
+        double da = *(const double *)a;
+        double db = *(const double *)b;
+
+        return da < db ? -1 : da > db;
+}
+
+static double
+median (double *values,
+        int     n)
+{
+        qsort (values, n, sizeof (double), compare_double);
+        return values[n / 2];
+}
+
+static void
+run_one (guint   n,
+         Sample *sample)
+{
+        g_auto(GStrv) choices = NULL;
+        g_auto(GStrv) update = NULL;
+        AppChooserDialog *dialog;
+        GtkWidget *list = NULL;
+        guint n_new;
+        gint64 start;
+
+        choices = make_choices (0, n);
+
+        /* An update that repeats everything and adds a few new apps,
+         * like the frontend sends while something is being installed.
+         */
+        n_new = MAX (n / 10, 1);
+        update = make_choices (0, n + n_new);
+
+        start = g_get_monotonic_time ();
+        dialog = app_chooser_dialog_new ((const char **)choices, choices[0], "text/plain", "/tmp/bench.txt");
+        sample->construct = (g_get_monotonic_time () - start) / 1000.0;
+
+        find_list_box (GTK_WIDGET (dialog), &list);
+        g_assert (list != NULL);
+
+        sample->more = sample->more_max = 0;
+        if (n > 3) {
+                GtkListBoxRow *more_row;
+
+                more_row = gtk_list_box_get_row_at_index (GTK_LIST_BOX (list), 3);
+
+                start = g_get_monotonic_time ();
+                g_signal_emit_by_name (list, "row-activated", more_row);
+                sample->more_max = wait_for_row (GTK_LIST_BOX (list), n) / 1000.0;
+                sample->more = (g_get_monotonic_time () - start) / 1000.0;
+        }
+
+        flush_events ();
+
+        start = g_get_monotonic_time ();
+        app_chooser_dialog_update_choices (dialog, (const char **)update);
+        sample->update = (g_get_monotonic_time () - start) / 1000.0;
+
+        sample->update_rows = 0;
+        if (n > 3) {
+                wait_for_row (GTK_LIST_BOX (list), n + n_new);
+                sample->update_rows = (g_get_monotonic_time () - start) / 1000.0;
+        }
+
+        gtk_widget_destroy (GTK_WIDGET (dialog));
+        flush_events ();
+}
+
+static void
+run_benchmark (void)
+{
+        const guint sizes[] = { 3, 50, 500, 5000 };
+        gint64 start;
+        guint i;
+
+        start = g_get_monotonic_time ();
+        app_info_index_ensure ();
+        while (!app_info_index_is_ready ())
+                g_main_context_iteration (NULL, TRUE);
+        g_print ("desktop file index ready after %.1f ms\n\n",
+                 (g_get_monotonic_time () - start) / 1000.0);
+
+        g_print ("%8s %12s %12s %12s %12s %14s\n",
+                 "choices", "new (ms)", "more (ms)", "max iter", "update (ms)", "update rows");
+
+        for (i = 0; i < G_N_ELEMENTS (sizes); i++) {
+                g_autofree double *construct = g_new (double, opt_repeat);
+                g_autofree double *more = g_new (double, opt_repeat);
+                g_autofree double *more_max = g_new (double, opt_repeat);
+                g_autofree double *update = g_new (double, opt_repeat);
+                g_autofree double *update_rows = g_new (double, opt_repeat);
+                int j;
+
+                for (j = 0; j < opt_repeat; j++) {
+                        Sample sample;
+
+                        run_one (sizes[i], &sample);
+                        construct[j] = sample.construct;
+                        more[j] = sample.more;
+                        more_max[j] = sample.more_max;
+                        update[j] = sample.update;
+                        update_rows[j] = sample.update_rows;
+                }
+
+                g_print ("%8u %12.2f %12.2f %12.2f %12.3f %14.2f\n",
+                         sizes[i],
+                         median (construct, opt_repeat),
+                         median (more, opt_repeat),
+                         median (more_max, opt_repeat),
+                         median (update, opt_repeat),
+                         median (update_rows, opt_repeat));
+        }
+}
 
 int
 main (int argc, char *argv[])
@@ -30,11 +278,51 @@ main (int argc, char *argv[])
           { "default", 0, 0, G_OPTION_ARG_STRING, &default_id, "The default choice", "ID" },
           { "content-type", 0, 0, G_OPTION_ARG_STRING, &content_type, "The content type", "TYPE" },
           { "location", 0, 0, G_OPTION_ARG_STRING, &location, "The location (file or uri)", "LOCATION" },
+          { "benchmark", 0, 0, G_OPTION_ARG_NONE, &opt_benchmark, "Time the dialog with generated apps", NULL },
+          { "repeat", 0, 0, G_OPTION_ARG_INT, &opt_repeat, "Runs per list size in benchmark mode", "N" },
           { NULL, }
         };
 
+        /* The environment has to be in place before GIO looks at
+         * desktop files for the first time, so peek at the arguments.
+         */
+        for (i = 1; i < argc; i++) {
+                if (strcmp (argv[i], "--benchmark") == 0) {
+                        g_autofree char *home = NULL;
+                        g_autofree char *data_dirs = NULL;
+                        const char *system_dirs;
+
+                        data_dir = g_dir_make_tmp ("testappchooser-XXXXXX", NULL);
+                        if (data_dir == NULL)
+                                g_error ("Could not create a temporary directory");
+
+                        home = g_build_filename (data_dir, "home", NULL);
+                        /* Keep the system dirs for the icon theme */
+                        system_dirs = g_getenv ("XDG_DATA_DIRS");
+                        if (system_dirs == NULL || *system_dirs == '\0')
+                                system_dirs = "/usr/local/share:/usr/share";
+                        data_dirs = g_strconcat (data_dir, ":", system_dirs, NULL);
+                        g_setenv ("XDG_DATA_DIRS", data_dirs, TRUE);
+                        g_setenv ("XDG_DATA_HOME", home, TRUE);
+
+                        write_desktop_files (5000 + 5000 / 10);
+                        break;
+                }
+        }
+
         gtk_init_with_args (&argc, &argv, "APP...", entries, NULL, NULL);
 
+        if (opt_benchmark) {
+                if (opt_repeat < 1)
+                        opt_repeat = 1;
+
+                run_benchmark ();
+                remove_recursively (data_dir);
+                g_free (data_dir);
+
+                return 0;
+        }
+
         apps = g_new (const char *, argc);
         for (i = 0; i + 1 < argc; i++)
                 apps[i] = argv[i + 1];
@@ -28,6 +28,7 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <signal.h>
 
 #include <gtk/gtk.h>
 
@@ -36,6 +37,7 @@
 #include <gio/gunixfdlist.h>
 
 #include <glib/gi18n.h>
+#include <glib-unix.h>
 #include <locale.h>
 
 #include "xdg-desktop-portal-dbus.h"
@@ -51,6 +53,7 @@
 #include "dynamic-launcher.h"
 
 #include "notification.h"
+#include "fdonotification.h"
 #include "inhibit.h"
 #include "access.h"
 #include "account.h"
@@ -74,11 +77,23 @@ static GHashTable *outstanding_handles = NULL;
 
 static gboolean opt_verbose;
 static gboolean opt_replace;
+static gboolean opt_close_notifications;
+static int opt_max_app_notifications = -1;
+static int opt_max_notifications = -1;
+static int opt_notification_max_age = -1;
+static char **opt_no_recent;
+static int opt_max_print_jobs = -1;
 static gboolean show_version;
 
 static GOptionEntry entries[] = {
   { "verbose", 'v', 0, G_OPTION_ARG_NONE, &opt_verbose, "Print debug information during command processing", NULL },
   { "replace", 'r', 0, G_OPTION_ARG_NONE, &opt_replace, "Replace a running instance", NULL },
+  { "close-notifications-on-exit", 0, 0, G_OPTION_ARG_NONE, &opt_close_notifications, "Close transient notifications of apps that exit", NULL },
+  { "max-app-notifications", 0, 0, G_OPTION_ARG_INT, &opt_max_app_notifications, "Maximum number of notifications tracked per app, older ones are closed (0 for no limit)", "N" },
+  { "max-notifications", 0, 0, G_OPTION_ARG_INT, &opt_max_notifications, "Maximum number of notifications tracked in total, older ones are closed (0 for no limit)", "N" },
+  { "notification-max-age", 0, 0, G_OPTION_ARG_INT, &opt_notification_max_age, "Close notifications that have not been updated for SECONDS (0 to never)", "SECONDS" },
+  { "no-recent-files", 0, 0, G_OPTION_ARG_STRING_ARRAY, &opt_no_recent, "Don't add files chosen by APP to recent files", "APP" },
+  { "max-print-jobs", 0, 0, G_OPTION_ARG_INT, &opt_max_print_jobs, "Maximum number of print jobs handled at a time (0 for no limit)", "N" },
   { "version", 0, 0, G_OPTION_ARG_NONE, &show_version, "Show program version.", NULL},
   { NULL }
 };
@@ -110,6 +125,17 @@ printerr_handler (const gchar *string)
   fprintf (stderr, "%serror: %s%s\n", prefix, suffix, string);
 }
 
+/* With --verbose, SIGUSR1 logs internal state that is otherwise hard
+ * to get at.
+ */
+static gboolean
+dump_state (gpointer data)
+{
+  inhibit_dump_state ();
+
+  return G_SOURCE_CONTINUE;
+}
+
 static void
 on_bus_acquired (GDBusConnection *connection,
                  const gchar     *name,
@@ -263,10 +289,21 @@ main (int argc, char *argv[])
   g_set_printerr_handler (printerr_handler);
 
   if (opt_verbose)
-    g_log_set_handler (NULL, G_LOG_LEVEL_DEBUG, message_handler, NULL);
+    {
+      g_log_set_handler (NULL, G_LOG_LEVEL_DEBUG, message_handler, NULL);
+      g_unix_signal_add (SIGUSR1, dump_state, NULL);
+    }
 
   g_set_prgname ("xdg-desktop-portal-gtk");
 
+  fdo_set_close_transient_on_exit (opt_close_notifications);
+  fdo_set_notification_limits (opt_max_app_notifications,
+                               opt_max_notifications,
+                               opt_notification_max_age);
+  file_chooser_set_no_recent_apps ((const char * const *) opt_no_recent);
+  if (opt_max_print_jobs >= 0)
+    print_set_max_jobs (opt_max_print_jobs);
+
   loop = g_main_loop_new (NULL, FALSE);
 
   outstanding_handles = g_hash_table_new (g_str_hash, g_str_equal);